@@ -0,0 +1,262 @@
+/**
+ * @file search_bench.c
+ * @author Joakim Bertils
+ * @version 0.1
+ * @date 2021-04-18
+ *
+ * @brief Benchmark of the search kernel against strstr on rows.
+ *
+ * @copyright Copyright (C) 2021, Joakim Bertils
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https: //www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Usage: search_bench [MiB] [needle...]
+ *
+ * Fills MiB of memory (2048 by default) with log lines, and counts the lines
+ * that contain each needle in three ways:
+ *
+ *   strstr rows    The old search: strstr on every row, one NUL terminated
+ *                  row at a time.
+ *   scanFind rows  The new kernel, still called once per row.
+ *   scanFind runs  The new kernel over the whole text at once, going on from
+ *                  the next line after every match, as the search does over
+ *                  untouched lines of a mapping.
+ *
+ * A needle in lower case is also searched for without case, against
+ * strcasestr on every row.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "scan.h"
+
+#define BENCH_REPEATS 3
+#define BENCH_DEFAULT_MIB 2048
+
+static const char *benchDefaultNeedles[] = {"zqxv", "user=71334", "served",
+                                            "ERROR", NULL};
+
+static double benchNow() {
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/**
+ * Fills buf with log lines, each ending in a line break. The length of every
+ * line, without the line break, goes in lens. Returns the number of lines.
+ */
+static size_t benchFill(char *buf, size_t size, uint32_t *lens) {
+  static const char *levels[] = {"INFO", "DEBUG", "WARN", "ERROR"};
+  uint64_t seed = 88172645463325252ull;
+  size_t at = 0;
+  size_t n = 0;
+  char line[128];
+
+  while (1) {
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+
+    int len = snprintf(line, sizeof(line),
+                       "2024-01-01T%02d:%02d:%02d %s request %zu served in "
+                       "%dms user=%d",
+                       (int)(n / 3600 % 24), (int)(n / 60 % 60), (int)(n % 60),
+                       levels[seed % 4], n, (int)((seed >> 8) % 1000),
+                       (int)((seed >> 20) % 100000));
+
+    if (at + len + 1 > size) {
+      break;
+    }
+
+    memcpy(&buf[at], line, len);
+    buf[at + len] = '\n';
+
+    lens[n++] = len;
+    at += len + 1;
+  }
+
+  memset(&buf[at], '\n', size - at);
+
+  return n;
+}
+
+/**
+ * Counts the rows that contain the needle with strstr, or strcasestr when
+ * icase is set. The rows are NUL terminated, like render used to be.
+ */
+static size_t benchStrstr(const char *buf, const uint32_t *lens, size_t n,
+                          const char *needle, int icase) {
+  const char *row = buf;
+  size_t count = 0;
+
+  for (size_t i = 0; i < n; ++i) {
+    count += (icase ? strcasestr(row, needle) : strstr(row, needle)) != NULL;
+    row += lens[i] + 1;
+  }
+
+  return count;
+}
+
+/**
+ * Counts the rows that contain the needle by calling scanFind on every row.
+ */
+static size_t benchScanRows(const char *buf, const uint32_t *lens, size_t n,
+                            const char *needle, int icase) {
+  const char *row = buf;
+  int nlen = strlen(needle);
+  size_t count = 0;
+
+  for (size_t i = 0; i < n; ++i) {
+    count += scanFind(row, lens[i], needle, nlen, icase) != NULL;
+    row += lens[i] + 1;
+  }
+
+  return count;
+}
+
+/**
+ * Counts the lines that contain the needle by calling scanFind on all of the
+ * text, and going on from the next line after every match.
+ */
+static size_t benchScanRuns(const char *buf, size_t size, const char *needle,
+                            int icase) {
+  int nlen = strlen(needle);
+  size_t count = 0;
+  size_t at = 0;
+
+  while (at < size) {
+    const char *hit = scanFind(&buf[at], size - at, needle, nlen, icase);
+
+    if (hit == NULL) {
+      break;
+    }
+
+    const char *end = memchr(hit, '\n', &buf[size] - hit);
+
+    ++count;
+    at = end ? (size_t)(end - buf) + 1 : size;
+  }
+
+  return count;
+}
+
+/**
+ * Swaps every line break in buf for a NUL, or back.
+ */
+static void benchTerminate(char *buf, const uint32_t *lens, size_t n, char c) {
+  char *row = buf;
+
+  for (size_t i = 0; i < n; ++i) {
+    row[lens[i]] = c;
+    row += lens[i] + 1;
+  }
+}
+
+static void benchReport(const char *name, double best, size_t size,
+                        size_t count) {
+  printf("  %-16s %8.1f ms %6.2f GB/s %10zu rows\n", name, best * 1e3,
+         size / best / 1e9, count);
+}
+
+static void benchNeedle(char *buf, size_t size, const uint32_t *lens,
+                        size_t n, const char *needle, int icase) {
+  double best[3] = {1e9, 1e9, 1e9};
+  size_t count[3] = {0, 0, 0};
+
+  printf("\"%s\"%s\n", needle, icase ? " ignoring case" : "");
+
+  for (int rep = 0; rep < BENCH_REPEATS; ++rep) {
+    double t;
+
+    benchTerminate(buf, lens, n, '\0');
+
+    t = benchNow();
+    count[0] = benchStrstr(buf, lens, n, needle, icase);
+    t = benchNow() - t;
+    best[0] = t < best[0] ? t : best[0];
+
+    benchTerminate(buf, lens, n, '\n');
+
+    t = benchNow();
+    count[1] = benchScanRows(buf, lens, n, needle, icase);
+    t = benchNow() - t;
+    best[1] = t < best[1] ? t : best[1];
+
+    t = benchNow();
+    count[2] = benchScanRuns(buf, size, needle, icase);
+    t = benchNow() - t;
+    best[2] = t < best[2] ? t : best[2];
+  }
+
+  benchReport(icase ? "strcasestr rows" : "strstr rows", best[0], size,
+              count[0]);
+  benchReport("scanFind rows", best[1], size, count[1]);
+  benchReport("scanFind runs", best[2], size, count[2]);
+
+  if (count[0] != count[1] || count[0] != count[2]) {
+    printf("  MISMATCH\n");
+  }
+}
+
+int main(int argc, char **argv) {
+  size_t mib = argc > 1 ? strtoull(argv[1], NULL, 10) : BENCH_DEFAULT_MIB;
+  size_t size = mib << 20;
+  char *buf = malloc(size);
+  uint32_t *lens = malloc(size / 16 * sizeof(uint32_t));
+
+  if (mib == 0 || buf == NULL || lens == NULL) {
+    fprintf(stderr, "usage: %s [MiB] [needle...]\n", argv[0]);
+    return 1;
+  }
+
+  size_t n = benchFill(buf, size, lens);
+
+  printf("%zu MiB, %zu lines, best of %d\n", mib, n, BENCH_REPEATS);
+
+  const char **needles = benchDefaultNeedles;
+
+  if (argc > 2) {
+    needles = (const char **)&argv[2];
+  }
+
+  for (int i = 0; needles[i]; ++i) {
+    int lower = 1;
+
+    for (const char *c = needles[i]; *c; ++c) {
+      lower &= !(*c >= 'A' && *c <= 'Z');
+    }
+
+    benchNeedle(buf, size, lens, n, needles[i], 0);
+
+    if (lower) {
+      benchNeedle(buf, size, lens, n, needles[i], 1);
+    }
+  }
+
+  free(lens);
+  free(buf);
+
+  return 0;
+}
@@ -0,0 +1,295 @@
+/**
+ * @file arena.c
+ * @author Joakim Bertils
+ * @version 0.1
+ * @date 2021-04-18
+ *
+ * @brief Size class allocator for row storage.
+ *
+ * @copyright Copyright (C) 2021, Joakim Bertils
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https: //www.gnu.org/licenses/>.
+ *
+ */
+
+#include "arena.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+extern void die(const char *s);
+
+/**
+ * Every block is preceded by the index of its size class, so that blocks can
+ * be freed and resized without the caller remembering their size.
+ */
+struct arenaHeader {
+  size_t cls;
+};
+
+struct arenaChunk {
+  struct arenaChunk *next;
+  size_t pad;
+};
+
+struct arenaLarge {
+  struct arenaLarge *prev;
+  struct arenaLarge *next;
+  size_t size;
+  struct arenaHeader header;
+};
+
+#define AR_LARGE AR_NUM_CLASSES
+
+static const size_t arClassSize[AR_NUM_CLASSES] = {
+    16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048};
+
+static size_t arClassOf(size_t size) {
+  size_t cls = 0;
+
+  while (cls < AR_NUM_CLASSES && arClassSize[cls] < size) {
+    ++cls;
+  }
+
+  return cls;
+}
+
+static struct arenaHeader *arHeader(void *p) {
+  return (struct arenaHeader *)p - 1;
+}
+
+static struct arenaLarge *arLargeOf(struct arenaHeader *header) {
+  return (struct arenaLarge *)((char *)header -
+                               offsetof(struct arenaLarge, header));
+}
+
+static void arLinkLarge(struct arena *ar, struct arenaLarge *large) {
+  large->prev = NULL;
+  large->next = ar->large;
+
+  if (ar->large) {
+    ar->large->prev = large;
+  }
+
+  ar->large = large;
+}
+
+static void arUnlinkLarge(struct arena *ar, struct arenaLarge *large) {
+  if (large->prev) {
+    large->prev->next = large->next;
+  } else {
+    ar->large = large->next;
+  }
+
+  if (large->next) {
+    large->next->prev = large->prev;
+  }
+}
+
+static void *arAllocLarge(struct arena *ar, size_t size) {
+  struct arenaLarge *large = malloc(sizeof(struct arenaLarge) + size);
+
+  if (!large) {
+    die("malloc");
+  }
+
+  large->size = size;
+  large->header.cls = AR_LARGE;
+  arLinkLarge(ar, large);
+
+  ar->stats.sysAllocs++;
+  ar->stats.inUse += size;
+  ar->stats.reserved += size;
+
+  return large + 1;
+}
+
+/**
+ * Carves a block out of the current chunk, starting a new chunk when the
+ * current one is exhausted. The tail of the old chunk is simply abandoned.
+ */
+static void *arCarve(struct arena *ar, size_t cls) {
+  size_t need = sizeof(struct arenaHeader) + arClassSize[cls];
+
+  if (ar->cur == NULL || (size_t)(ar->end - ar->cur) < need) {
+    struct arenaChunk *chunk = malloc(AR_CHUNK_SIZE);
+
+    if (!chunk) {
+      die("malloc");
+    }
+
+    chunk->next = ar->chunks;
+    ar->chunks = chunk;
+
+    ar->cur = (char *)(chunk + 1);
+    ar->end = (char *)chunk + AR_CHUNK_SIZE;
+
+    ar->stats.sysAllocs++;
+    ar->stats.reserved += AR_CHUNK_SIZE;
+  }
+
+  struct arenaHeader *header = (struct arenaHeader *)ar->cur;
+
+  ar->cur += need;
+  header->cls = cls;
+
+  return header + 1;
+}
+
+void arInit(struct arena *ar) { memset(ar, 0, sizeof(*ar)); }
+
+void arRelease(struct arena *ar) {
+  while (ar->chunks) {
+    struct arenaChunk *next = ar->chunks->next;
+    free(ar->chunks);
+    ar->chunks = next;
+  }
+
+  while (ar->large) {
+    struct arenaLarge *next = ar->large->next;
+    free(ar->large);
+    ar->large = next;
+  }
+
+  arInit(ar);
+}
+
+void *arAlloc(struct arena *ar, size_t size) {
+  size_t cls = arClassOf(size);
+
+  ar->stats.allocs++;
+
+  if (cls == AR_LARGE) {
+    return arAllocLarge(ar, size);
+  }
+
+  ar->stats.inUse += arClassSize[cls];
+
+  void *p = ar->freeLists[cls];
+
+  if (p) {
+    // Free blocks keep the link to the next free block in their payload.
+    ar->freeLists[cls] = *(void **)p;
+    return p;
+  }
+
+  return arCarve(ar, cls);
+}
+
+void *arRealloc(struct arena *ar, void *p, size_t size) {
+  if (!p) {
+    return arAlloc(ar, size);
+  }
+
+  struct arenaHeader *header = arHeader(p);
+  size_t old;
+
+  if (header->cls == AR_LARGE) {
+    struct arenaLarge *large = arLargeOf(header);
+
+    if (arClassOf(size) == AR_LARGE) {
+      // Stay a large block and let realloc try to grow it in place.
+      arUnlinkLarge(ar, large);
+
+      struct arenaLarge *new = realloc(large, sizeof(struct arenaLarge) + size);
+
+      if (!new) {
+        die("realloc");
+      }
+
+      ar->stats.inUse += size - new->size;
+      ar->stats.reserved += size - new->size;
+      new->size = size;
+      arLinkLarge(ar, new);
+
+      return new + 1;
+    }
+
+    old = large->size;
+  } else {
+    old = arClassSize[header->cls];
+
+    // The block already has room for the new size.
+    if (size <= old && arClassOf(size) == header->cls) {
+      return p;
+    }
+  }
+
+  void *new = arAlloc(ar, size);
+
+  memcpy(new, p, old < size ? old : size);
+  arFree(ar, p);
+
+  return new;
+}
+
+void arFree(struct arena *ar, void *p) {
+  if (!p) {
+    return;
+  }
+
+  struct arenaHeader *header = arHeader(p);
+
+  ar->stats.frees++;
+
+  if (header->cls == AR_LARGE) {
+    struct arenaLarge *large = arLargeOf(header);
+
+    ar->stats.inUse -= large->size;
+    ar->stats.reserved -= large->size;
+
+    arUnlinkLarge(ar, large);
+    free(large);
+    return;
+  }
+
+  ar->stats.inUse -= arClassSize[header->cls];
+
+  *(void **)p = ar->freeLists[header->cls];
+  ar->freeLists[header->cls] = p;
+}
+
+void arAdopt(struct arena *ar, struct arena *from) {
+  while (from->chunks) {
+    struct arenaChunk *next = from->chunks->next;
+
+    from->chunks->next = ar->chunks;
+    ar->chunks = from->chunks;
+    from->chunks = next;
+  }
+
+  while (from->large) {
+    struct arenaLarge *large = from->large;
+
+    arUnlinkLarge(from, large);
+    arLinkLarge(ar, large);
+  }
+
+  for (size_t cls = 0; cls < AR_NUM_CLASSES; ++cls) {
+    while (from->freeLists[cls]) {
+      void *p = from->freeLists[cls];
+
+      from->freeLists[cls] = *(void **)p;
+      *(void **)p = ar->freeLists[cls];
+      ar->freeLists[cls] = p;
+    }
+  }
+
+  ar->stats.allocs += from->stats.allocs;
+  ar->stats.frees += from->stats.frees;
+  ar->stats.sysAllocs += from->stats.sysAllocs;
+  ar->stats.inUse += from->stats.inUse;
+  ar->stats.reserved += from->stats.reserved;
+
+  arInit(from);
+}
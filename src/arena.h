@@ -0,0 +1,81 @@
+/**
+ * @file arena.h
+ * @author Joakim Bertils
+ * @version 0.1
+ * @date 2021-04-18
+ *
+ * @brief Per buffer allocator for row storage.
+ *
+ * @copyright Copyright (C) 2021, Joakim Bertils
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https: //www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _ARENA_H
+#define _ARENA_H
+
+#include <stddef.h>
+
+/**
+ * Size of the chunks that small blocks are carved out of.
+ */
+#define AR_CHUNK_SIZE (64 << 10)
+
+/**
+ * Number of size classes. Requests larger than the biggest class are handed
+ * to malloc directly, but are still tracked by the arena.
+ */
+#define AR_NUM_CLASSES 14
+
+struct arenaChunk;
+struct arenaLarge;
+
+struct arenaStats {
+  size_t allocs;
+  size_t frees;
+  size_t sysAllocs;
+  size_t inUse;
+  size_t reserved;
+};
+
+/**
+ * All row payloads and tree nodes of a buffer come from its arena. Freed
+ * blocks go on a free list for their size class and are reused, and the whole
+ * arena is handed back to the system in one go when the buffer is destroyed.
+ */
+struct arena {
+  char *cur;
+  char *end;
+
+  struct arenaChunk *chunks;
+  struct arenaLarge *large;
+
+  void *freeLists[AR_NUM_CLASSES];
+
+  struct arenaStats stats;
+};
+
+void arInit(struct arena *ar);
+void arRelease(struct arena *ar);
+void *arAlloc(struct arena *ar, size_t size);
+void *arRealloc(struct arena *ar, void *p, size_t size);
+void arFree(struct arena *ar, void *p);
+
+/**
+ * Moves every block of from into ar, leaving from empty. Blocks allocated
+ * from either arena can then be freed through ar.
+ */
+void arAdopt(struct arena *ar, struct arena *from);
+
+#endif
@@ -32,6 +32,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <termios.h>
 #include <time.h>
@@ -39,10 +41,15 @@
 
 #include "append_buffer.h"
 #include "editor.h"
+#include "grep.h"
 #include "key.h"
+#include "line_store.h"
+#include "mapped_file.h"
 #include "row.h"
+#include "search.h"
 #include "syntax.h"
 #include "terminal.h"
+#include "trigram.h"
 
 #define JDEDIT_TAB_STOP 4
 
@@ -50,40 +57,58 @@ extern void die(const char *s);
 
 editorConfig_t E;
 
+static int editorReadKey();
+static void editorRequestRedraw();
 static void editorDrawRows(struct appendBuffer *ab);
 static void editorDrawStatusBar(struct appendBuffer *ab);
 static void editorDrawMessageBar(struct appendBuffer *ab);
+static void editorStopGrep(struct editorGrep *grep);
 
-void editorInsertRow(editorConfig_t *conf, int at, char *s, size_t len) {
-  if (at < 0 || at > conf->activeBuffer->numrows) {
-    return;
+static int editorBufferWritable(editorConfig_t *conf) {
+  if (conf->activeBuffer->readonly) {
+    editorSetStatusMessage("Buffer is read-only");
+    return 0;
   }
 
-  conf->activeBuffer->row =
-      realloc(conf->activeBuffer->row,
-              sizeof(erow) * (conf->activeBuffer->numrows + 1));
-  memmove(&conf->activeBuffer->row[at + 1], &conf->activeBuffer->row[at],
-          sizeof(erow) * (conf->activeBuffer->numrows - at));
+  return 1;
+}
+
+erow *editorGetRow(buffer_t *buffer, int at) {
+  return lsGetRow(&buffer->rows, at);
+}
+
+erow *editorDetachRow(buffer_t *buffer, int at) {
+  return lsDetachRow(&buffer->rows, at);
+}
 
-  for (int j = at + 1; j <= conf->activeBuffer->numrows; ++j) {
-    conf->activeBuffer->row[j].idx++;
+void editorInsertRow(editorConfig_t *conf, int at, char *s, size_t len) {
+  if (at < 0 || at > conf->activeBuffer->numrows) {
+    return;
   }
 
-  conf->activeBuffer->row[at].idx = at;
+  erow *row = lsInsertRow(&conf->activeBuffer->rows, at);
 
-  conf->activeBuffer->row[at].size = len;
-  conf->activeBuffer->row[at].chars = malloc(len + 1);
-  memcpy(conf->activeBuffer->row[at].chars, s, len);
-  conf->activeBuffer->row[at].chars[len] = '\0';
+  row->size = len;
+  row->chars = arAlloc(&conf->activeBuffer->arena, len + 1);
+  memcpy(row->chars, s, len);
+  row->chars[len] = '\0';
+  row->gap = len;
+  row->gap_len = 0;
+  row->tabs = NULL;
+  row->ntabs = -1;
 
-  conf->activeBuffer->row[at].rsize = 0;
-  conf->activeBuffer->row[at].render = 0;
+  row->rsize = 0;
+  row->render = 0;
 
-  conf->activeBuffer->row[at].hl = NULL;
+  row->hl = NULL;
+  row->hl_spans = 0;
 
-  conf->activeBuffer->row[at].hl_open_comment = 0;
+  row->hl_entry = -1;
+  row->hl_open_comment = 0;
+  row->stale = 1;
 
-  editorUpdateRow(conf, &conf->activeBuffer->row[at]);
+  editorInvalidateSyntax(conf, at, 1);
+  editorUpdateRow(conf, row);
 
   conf->activeBuffer->numrows++;
   conf->activeBuffer->dirty++;
@@ -94,26 +119,26 @@ void editorDelRow(editorConfig_t *conf, int at) {
     return;
   }
 
-  editorFreeRow(&conf->activeBuffer->row[at]);
+  lsDelRow(&conf->activeBuffer->rows, at);
 
-  memmove(&conf->activeBuffer->row[at], &conf->activeBuffer->row[at + 1],
-          sizeof(erow) * (conf->activeBuffer->numrows - at - 1));
-
-  for (int j = at; j < conf->activeBuffer->numrows - 1; ++j) {
-    conf->activeBuffer->row[j].idx--;
-  }
+  editorInvalidateSyntax(conf, at, -1);
 
   conf->activeBuffer->numrows--;
   conf->activeBuffer->dirty++;
 }
 
 void editorInsertChar(editorConfig_t *conf, int c) {
+  if (!editorBufferWritable(conf)) {
+    return;
+  }
+
   if (conf->activeBuffer->cy == conf->activeBuffer->numrows) {
     editorInsertRow(conf, conf->activeBuffer->numrows, "", 0);
   }
 
-  editorRowInsertChar(conf, &conf->activeBuffer->row[conf->activeBuffer->cy],
-                      conf->activeBuffer->cx, c);
+  erow *row = editorDetachRow(conf->activeBuffer, conf->activeBuffer->cy);
+
+  editorRowInsertChar(conf, row, conf->activeBuffer->cx, c);
 
   ++conf->activeBuffer->cx;
 }
@@ -121,20 +146,24 @@ void editorInsertChar(editorConfig_t *conf, int c) {
 void editorInsertNewline(editorConfig_t *conf) {
   int leadingTabs = 0;
 
+  if (!editorBufferWritable(conf)) {
+    return;
+  }
+
   if (conf->activeBuffer->cx == 0) {
     editorInsertRow(conf, conf->activeBuffer->cy, "", 0);
   } else {
-    erow *row = &conf->activeBuffer->row[conf->activeBuffer->cy];
+    erow *row = editorDetachRow(conf->activeBuffer, conf->activeBuffer->cy);
     editorInsertRow(conf, conf->activeBuffer->cy + 1,
-                    &row->chars[conf->activeBuffer->cx],
+                    &editorRowChars(row)[conf->activeBuffer->cx],
                     row->size - conf->activeBuffer->cx);
-    row = &conf->activeBuffer->row[conf->activeBuffer->cy];
-    row->size = conf->activeBuffer->cx;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(conf, row);
+    row = editorDetachRow(conf->activeBuffer, conf->activeBuffer->cy);
+    editorRowTruncate(conf, row, conf->activeBuffer->cx);
+
+    char *chars = editorRowChars(row);
 
     for (int i = 0; i < row->size; ++i) {
-      if (row->chars[i] == '\t') {
+      if (chars[i] == '\t') {
         ++leadingTabs;
       } else {
         break;
@@ -151,6 +180,10 @@ void editorInsertNewline(editorConfig_t *conf) {
 }
 
 void editorDelChar(editorConfig_t *conf) {
+  if (!editorBufferWritable(conf)) {
+    return;
+  }
+
   if (conf->activeBuffer->cy == conf->activeBuffer->numrows) {
     return;
   }
@@ -159,17 +192,18 @@ void editorDelChar(editorConfig_t *conf) {
     return;
   }
 
-  erow *row = &conf->activeBuffer->row[conf->activeBuffer->cy];
-
   if (conf->activeBuffer->cx > 0) {
+    erow *row = editorDetachRow(conf->activeBuffer, conf->activeBuffer->cy);
+
     editorRowDelChar(conf, row, conf->activeBuffer->cx - 1);
     conf->activeBuffer->cx--;
   } else {
-    conf->activeBuffer->cx =
-        conf->activeBuffer->row[conf->activeBuffer->cy - 1].size;
-    editorRowAppendString(conf,
-                          &conf->activeBuffer->row[conf->activeBuffer->cy - 1],
-                          row->chars, row->size);
+    erow *prev =
+        editorDetachRow(conf->activeBuffer, conf->activeBuffer->cy - 1);
+    erow *row = editorGetRow(conf->activeBuffer, conf->activeBuffer->cy);
+
+    conf->activeBuffer->cx = prev->size;
+    editorRowAppendString(conf, prev, editorRowChars(row), row->size);
     editorDelRow(conf, conf->activeBuffer->cy);
     conf->activeBuffer->cy--;
   }
@@ -203,6 +237,17 @@ void editorDestroyBuffer(editorConfig_t *conf, int idx) {
 
   buffer_t *buffer = conf->buffers[idx];
 
+  // Search results that point into the buffer are left pointing nowhere.
+  for (int i = 0; i < conf->numBuffers; ++i) {
+    buffer_t *results = conf->buffers[i];
+
+    for (int j = 0; j < results->nhits; ++j) {
+      if (results->hits[j].buffer == buffer) {
+        results->hits[j].buffer = NULL;
+      }
+    }
+  }
+
   freeBuffer(buffer);
 
   free(buffer);
@@ -288,248 +333,1157 @@ void initBuffer(buffer_t *buffer) {
   buffer->cy = 0;
   buffer->rx = 0;
 
-  buffer->rowoff = 0;
-  buffer->coloff = 0;
+  buffer->rowoff = 0;
+  buffer->coloff = 0;
+
+  buffer->linum_width = 0;
+  buffer->linum_mode = 1;
+
+  buffer->numrows = 0;
+  arInit(&buffer->arena);
+  lsInit(&buffer->rows, NULL, &buffer->arena);
+  buffer->hl_frontier = 0;
+  buffer->hl_valid = 0;
+  buffer->overlays = NULL;
+  buffer->noverlays = 0;
+  buffer->overlays_cap = 0;
+  buffer->dirty = 0;
+
+  buffer->filename = NULL;
+  buffer->syntax = NULL;
+
+  buffer->map = NULL;
+  buffer->index = NULL;
+  buffer->readonly = 0;
+
+  buffer->results = 0;
+  buffer->hits = NULL;
+  buffer->nhits = 0;
+  buffer->hits_cap = 0;
+  buffer->grep = NULL;
+}
+
+void freeBuffer(buffer_t *buffer) {
+  if (buffer->grep) {
+    editorStopGrep(buffer->grep);
+  }
+
+  lsFree(&buffer->rows);
+
+  // The index may still be read from the mapping, so it goes first.
+  if (buffer->index) {
+    tiClose(buffer->index);
+    free(buffer->index);
+  }
+
+  if (buffer->map) {
+    mfClose(buffer->map);
+    free(buffer->map);
+  }
+
+  // Every row and tree node lives in the arena, so this is all it takes to
+  // free them.
+  arRelease(&buffer->arena);
+
+  free(buffer->overlays);
+  free(buffer->filename);
+  free(buffer->hits);
+}
+
+void editorClearOverlays(buffer_t *buffer) { buffer->noverlays = 0; }
+
+void editorAddOverlay(buffer_t *buffer, int row, int start, int len, int hl) {
+  // The array is kept between searches, so that marking matches does not
+  // allocate once it has grown large enough.
+  if (buffer->noverlays == buffer->overlays_cap) {
+    buffer->overlays_cap = buffer->overlays_cap ? buffer->overlays_cap * 2 : 16;
+    buffer->overlays = realloc(buffer->overlays, sizeof(struct hlOverlay) *
+                                                     buffer->overlays_cap);
+
+    if (buffer->overlays == NULL) {
+      die("realloc");
+    }
+  }
+
+  struct hlOverlay *overlay = &buffer->overlays[buffer->noverlays++];
+
+  overlay->row = row;
+  overlay->start = start;
+  overlay->len = len;
+  overlay->hl = hl;
+}
+
+char *editorRowsToString(int *buflen) {
+  int totlen = 0;
+  struct lineIter it;
+  erow *row;
+
+  lsIterInit(&E.activeBuffer->rows, 0, &it);
+
+  while ((row = lsIterNext(&it)) != NULL) {
+    totlen += row->size + 1;
+  }
+
+  *buflen = totlen;
+
+  char *buf = malloc(totlen);
+  char *p = buf;
+
+  lsIterInit(&E.activeBuffer->rows, 0, &it);
+
+  while ((row = lsIterNext(&it)) != NULL) {
+    memcpy(p, editorRowChars(row), row->size);
+    p += row->size;
+    *p = '\n';
+    ++p;
+  }
+
+  return buf;
+}
+
+/**
+ * Reads the whole file into memory. Regular files are mapped, anything else
+ * (pipes, character devices) is read in large blocks.
+ *
+ * Returns NULL if the file is empty or could not be read. *mapped is set to
+ * non-zero if the returned data must be released with munmap() instead of
+ * free().
+ */
+static char *editorReadFile(int fd, size_t *len, int *mapped) {
+  struct stat st;
+
+  *len = 0;
+  *mapped = 0;
+
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if (data != MAP_FAILED) {
+      madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+      *len = st.st_size;
+      *mapped = 1;
+
+      return data;
+    }
+  }
+
+  size_t cap = 0;
+  char *data = NULL;
+
+  while (1) {
+    if (*len == cap) {
+      cap = cap ? cap * 2 : (1 << 20);
+
+      char *new = realloc(data, cap);
+
+      if (!new) {
+        die("realloc");
+      }
+
+      data = new;
+    }
+
+    ssize_t n = read(fd, &data[*len], cap - *len);
+
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+
+    if (n <= 0) {
+      break;
+    }
+
+    *len += n;
+  }
+
+  if (*len == 0) {
+    free(data);
+    return NULL;
+  }
+
+  return data;
+}
+
+/**
+ * Appends all lines in data to the active buffer.
+ *
+ * Every row is built in a single pass and then linked into the line store in
+ * one go. Syntax highlighting is left to the caller so that the whole buffer
+ * can be highlighted in one sweep afterwards.
+ */
+static void editorLoadRows(buffer_t *buffer, const char *data, size_t len) {
+  const char *end = data + len;
+  const char *p = data;
+  int nlines = 0;
+
+  // memchr is vectorized in any reasonable libc, so let it find the line
+  // boundaries for us.
+  while ((p = memchr(p, '\n', end - p)) != NULL) {
+    ++nlines;
+    ++p;
+  }
+
+  if (len > 0 && data[len - 1] != '\n') {
+    ++nlines;
+  }
+
+  erow **rows = malloc(sizeof(erow *) * nlines);
+  int n = 0;
+
+  if (!rows) {
+    die("malloc");
+  }
+
+  p = data;
+
+  while (p < end) {
+    const char *nl = memchr(p, '\n', end - p);
+    const char *eol = nl ? nl : end;
+    size_t linelen = eol - p;
+
+    while (linelen > 0 && p[linelen - 1] == '\r') {
+      linelen--;
+    }
+
+    erow *row = lsNewRow(&buffer->rows);
+
+    row->size = linelen;
+    row->chars = arAlloc(&buffer->arena, linelen + 1);
+    memcpy(row->chars, p, linelen);
+    row->chars[linelen] = '\0';
+    row->gap = linelen;
+    row->gap_len = 0;
+    row->tabs = NULL;
+    row->ntabs = -1;
+
+    row->rsize = 0;
+    row->render = NULL;
+    row->hl = NULL;
+    row->hl_spans = 0;
+    row->hl_entry = -1;
+    row->hl_open_comment = 0;
+
+    // Render and highlight are left until the row is first drawn.
+    row->stale = 1;
+
+    rows[n++] = row;
+
+    p = nl ? nl + 1 : end;
+  }
+
+  lsAppendRows(&buffer->rows, rows, n);
+
+  buffer->numrows += n;
+
+  free(rows);
+}
+
+/**
+ * Puts the rows of the active buffer on top of map, which must hold the text
+ * of the buffer, in place of any mapping the buffer had before. The rows are
+ * materialized anew and highlighted from the top. If filename is given, the
+ * file is indexed under it when it is large enough.
+ */
+static void editorUseMapping(struct mappedFile *map, const char *filename) {
+  buffer_t *buffer = E.activeBuffer;
+
+  // The index may still be read from the mapping, so it goes first.
+  if (buffer->index) {
+    tiClose(buffer->index);
+    free(buffer->index);
+    buffer->index = NULL;
+  }
+
+  if (buffer->map) {
+    mfClose(buffer->map);
+    free(buffer->map);
+  }
+
+  buffer->map = map;
+  buffer->numrows = map->numLines;
+  buffer->hl_frontier = 0;
+  buffer->hl_valid = map->numLines;
+
+  // The whole file starts out as a single run of untouched lines.
+  lsFree(&buffer->rows);
+  arRelease(&buffer->arena);
+  lsInit(&buffer->rows, map, &buffer->arena);
+
+  if (map->numLines > 0) {
+    lsAppendRun(&buffer->rows, 0, map->numLines);
+  }
+
+  if (filename && map->size >= JDEDIT_INDEX_THRESHOLD) {
+    struct trigramIndex *index = malloc(sizeof(struct trigramIndex));
+
+    if (!index) {
+      die("malloc");
+    }
+
+    if (tiOpen(index, map, filename) == 0) {
+      buffer->index = index;
+    } else {
+      free(index);
+    }
+  }
+}
+
+/**
+ * Sets up the active buffer on top of a mapping of the file. Rows stay in the
+ * mapping until they are edited. No syntax is selected, since highlighting
+ * would give every row a copy of its own.
+ */
+static void editorMapFile(char *filename, int readonly) {
+  struct mappedFile *map = malloc(sizeof(struct mappedFile));
+
+  if (!map) {
+    die("malloc");
+  }
+
+  if (mfOpen(map, filename, &E.activeBuffer->arena) == -1) {
+    editorSetStatusMessage("Can't open %.20s: %s", filename, strerror(errno));
+    free(map);
+    return;
+  }
+
+  E.activeBuffer->filename = strdup(filename);
+
+  editorUseMapping(map, filename);
+
+  E.activeBuffer->readonly = readonly;
+  E.activeBuffer->dirty = 0;
+
+  editorSetStatusMessage("%s File: %.20s - %zu bytes mapped",
+                         readonly ? "Viewing" : "Opened", filename, map->size);
+}
+
+void editorOpen(char *filename) {
+  if (E.activeBuffer->filename && E.activeBuffer->dirty) {
+    char *response =
+        editorPrompt("Warning! Unsaved changes. Close anyway? y/n: %s", NULL);
+
+    if (!(strcmp(response, "y") == 0 || strcmp(response, "Y") == 0)) {
+      return;
+    }
+  }
+
+  struct stat st;
+
+  if (stat(filename, &st) == 0 && S_ISREG(st.st_mode) &&
+      st.st_size >= JDEDIT_MAP_THRESHOLD) {
+    editorMapFile(filename, 0);
+    return;
+  }
+
+  E.activeBuffer->filename = strdup(filename);
+
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1) {
+    // File did not exist. Create it.
+    fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (fd == -1) {
+      // File could not be opened.
+      die("open");
+    }
+  }
+
+  size_t bytes_read = 0;
+  int mapped = 0;
+  char *data = editorReadFile(fd, &bytes_read, &mapped);
+
+  if (data) {
+    editorLoadRows(E.activeBuffer, data, bytes_read);
+
+    if (mapped) {
+      munmap(data, bytes_read);
+    } else {
+      free(data);
+    }
+  }
+
+  close(fd);
+
+  editorSelectSyntaxHighlight(&E);
+
+  E.activeBuffer->dirty = 0;
+
+  editorSetStatusMessage("Opened File: %.20s - %zu bytes read", filename,
+                         bytes_read);
+}
+
+void editorView(char *filename) { editorMapFile(filename, 1); }
+
+int editorClose() {
+  while (E.numBuffers) {
+    editorLastBuffer(&E, NULL);
+
+    buffer_t *buffer = E.activeBuffer;
+
+    if (buffer->dirty) {
+      char buf[80];
+
+      int len = snprintf(
+          buf, sizeof(buf),
+          "Warning! %s contains unsaved changes. Exit anyway? y/n: %%s",
+          buffer->filename ? buffer->filename : "[no name]");
+
+      char *response = editorPrompt(buf, NULL);
+
+      if (!(strcmp(response, "y") == 0 || strcmp(response, "Y") == 0)) {
+        if (response) {
+          free(response);
+        }
+        return 1;
+      }
+
+      free(response);
+    }
+
+    editorDestroyBuffer(&E, E.numBuffers - 1);
+  }
+
+  return 0;
+}
+
+/**
+ * Creates the file to save the active buffer to before it takes the place of
+ * path. It is put next to path, so that it can be renamed over it, and
+ * otherwise in the temporary directory, in which case *beside is cleared.
+ * Returns the descriptor and stores the name in *tmp, or returns -1.
+ */
+static int editorSaveTemp(const char *path, char **tmp, int *beside) {
+  const char *dir = getenv("TMPDIR");
+  size_t len = strlen(path) + 8;
+  int fd;
+
+  *tmp = malloc(len);
+  *beside = 1;
+
+  if (*tmp == NULL) {
+    return -1;
+  }
+
+  snprintf(*tmp, len, "%s.XXXXXX", path);
+
+  if ((fd = mkstemp(*tmp)) != -1) {
+    return fd;
+  }
+
+  free(*tmp);
+
+  if (dir == NULL || *dir == '\0') {
+    dir = "/tmp";
+  }
+
+  len = strlen(dir) + 16;
+  *tmp = malloc(len);
+  *beside = 0;
+
+  if (*tmp == NULL) {
+    return -1;
+  }
+
+  snprintf(*tmp, len, "%s/jdedit.XXXXXX", dir);
+
+  if ((fd = mkstemp(*tmp)) == -1) {
+    free(*tmp);
+  }
+
+  return fd;
+}
+
+/**
+ * Copies the saved text in tmp over the file at path, for files that can not
+ * be replaced. The buffer is moved onto a mapping of tmp first, since the
+ * mapping of path changes under it, and back onto path once it is written.
+ * Returns the number of bytes written, or -1.
+ */
+static ssize_t editorSaveInPlace(const char *tmp, const char *path) {
+  struct mappedFile *map = malloc(sizeof(struct mappedFile));
+  ssize_t len = -1;
+
+  if (!map) {
+    die("malloc");
+  }
+
+  if (mfOpen(map, tmp, &E.activeBuffer->arena) == -1) {
+    free(map);
+    return -1;
+  }
+
+  editorUseMapping(map, NULL);
+
+  int fd = open(path, O_WRONLY | O_CREAT, 0644);
+
+  if (fd == -1) {
+    return -1;
+  }
+
+  if (mfWriteLines(map, fd, 0, map->numLines) != -1 &&
+      ftruncate(fd, map->size) == 0) {
+    len = map->size;
+  }
+
+  if (close(fd) != 0 || len == -1) {
+    return -1;
+  }
+
+  // Going back to the file itself frees the space taken by tmp.
+  map = malloc(sizeof(struct mappedFile));
+
+  if (!map) {
+    die("malloc");
+  }
+
+  if (mfOpen(map, path, &E.activeBuffer->arena) == 0) {
+    editorUseMapping(map, path);
+  } else {
+    free(map);
+  }
+
+  return len;
+}
+
+/**
+ * Saves a buffer backed by a mapping. The untouched rows are streamed
+ * straight out of the mapping, so the text is written to a new file first,
+ * which is then renamed over the old one. A symbolic link is followed, and
+ * the file it points to is replaced. The new file gets the owner, group and
+ * permission bits of the old one, but not its ACLs or extended attributes.
+ *
+ * A file with more than one hard link, one whose owner or permissions can
+ * not be kept, or one in a directory that can not be written to is written
+ * in place instead. That keeps everything about the file, but is not atomic.
+ */
+static void editorSaveMapped() {
+  buffer_t *buffer = E.activeBuffer;
+  char *path = realpath(buffer->filename, NULL);
+  struct stat st;
+  char *tmp;
+  int beside;
+  ssize_t len = -1;
+
+  // A file that is gone is saved under the name it was opened with.
+  if (path == NULL && (errno != ENOENT ||
+                       (path = strdup(buffer->filename)) == NULL)) {
+    editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+    return;
+  }
+
+  int exists = stat(path, &st) == 0;
+  int fd = editorSaveTemp(path, &tmp, &beside);
+
+  if (fd == -1) {
+    editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+    free(path);
+    return;
+  }
+
+  int replace = beside && !(exists && st.st_nlink > 1);
+
+  // The owner goes first, since changing it clears the set-user-ID bit.
+  if (replace && exists) {
+    replace = fchown(fd, st.st_uid, st.st_gid) == 0 &&
+              fchmod(fd, st.st_mode & 07777) == 0;
+  } else if (replace) {
+    replace = fchmod(fd, 0644) == 0;
+  }
+
+  len = lsWrite(&buffer->rows, fd);
+
+  if (close(fd) != 0) {
+    len = -1;
+  }
+
+  if (len != -1) {
+    if (replace) {
+      len = rename(tmp, path) == 0 ? len : -1;
+    } else {
+      len = editorSaveInPlace(tmp, path);
+    }
+  }
+
+  if (len == -1 || !replace) {
+    int err = errno;
+    unlink(tmp);
+    errno = err;
+  }
+
+  free(tmp);
+  free(path);
+
+  if (len == -1) {
+    editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+    return;
+  }
+
+  buffer->dirty = 0;
+  editorSetStatusMessage("Wrote File: %.20s - %zd bytes written",
+                         buffer->filename, len);
+}
+
+void editorSave() {
+  if (!editorBufferWritable(&E)) {
+    return;
+  }
+
+  if (E.activeBuffer->map) {
+    editorSaveMapped();
+    return;
+  }
+
+  if (E.activeBuffer->filename == NULL) {
+    E.activeBuffer->filename = editorPrompt("Save as: %s", NULL);
+
+    if (E.activeBuffer->filename == NULL) {
+      editorSetStatusMessage("Save Aborted");
+      return;
+    }
+
+    editorSelectSyntaxHighlight(&E);
+  }
+
+  int len;
+  char *buf = editorRowsToString(&len);
+
+  int fd = open(E.activeBuffer->filename, O_RDWR | O_CREAT, 0644);
+  if (fd != -1) {
+    if (ftruncate(fd, len) != -1) {
+      if (write(fd, buf, len) == len) {
+        close(fd);
+        free(buf);
+        E.activeBuffer->dirty = 0;
+        editorSetStatusMessage("Wrote File: %.20s - %d bytes written",
+                               E.activeBuffer->filename, len);
+        return;
+      }
+    }
+    close(fd);
+  }
+
+  free(buf);
+
+  editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+}
+
+/**
+ * Shows how much memory the rows of the active buffer use, how many
+ * allocations it took, and how much text is shared between chars and render.
+ */
+static void editorMemoryStats() {
+  struct arenaStats *stats = &E.activeBuffer->arena.stats;
+  size_t copied = 0;
+  size_t shared = 0;
+
+  // Rows of a mapping are not counted, that would mean visiting every line.
+  if (!E.activeBuffer->map) {
+    struct lineIter it;
+    erow *row;
+
+    lsIterInit(&E.activeBuffer->rows, 0, &it);
+
+    while ((row = lsIterNext(&it)) != NULL) {
+      if (row->stale) {
+        continue;
+      }
+
+      if (row->render == row->chars) {
+        shared += row->rsize;
+      } else {
+        copied += row->rsize;
+      }
+    }
+  }
+
+  editorSetStatusMessage("Rows: %d - %zu of %zu KiB in %zu mallocs, %zu "
+                         "allocs - render %zu KiB, %zu KiB shared",
+                         E.activeBuffer->numrows, stats->inUse >> 10,
+                         stats->reserved >> 10, stats->sysAllocs,
+                         stats->allocs, copied >> 10, shared >> 10);
+}
+
+static struct searchState search;
+
+void editorFindCallback(char *query, int key) {
+  int direction = 0;
+
+  editorClearOverlays(E.activeBuffer);
+
+  if (key == '\r' || key == '\x1b') {
+    srReset(&search);
+    return;
+  } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
+    direction = 1;
+  } else if (key == ARROW_LEFT || key == ARROW_UP) {
+    direction = -1;
+  }
+
+  srUpdate(&search, E.activeBuffer, query);
+
+  // Nothing is searched for until something is typed.
+  if (query[0] == '\0') {
+    return;
+  }
+
+  // The arrow keys step through the rows with matches, while anything else
+  // starts over at the first one.
+  if (direction == 0) {
+    search.current = -1;
+  }
+
+  int current = srNext(&search, direction);
+
+  if (current != -1) {
+    erow *row = editorGetRow(E.activeBuffer, current);
+    const char *chars = editorRowChars(row);
+    int mlen;
+
+    E.activeBuffer->cy = current;
+    E.activeBuffer->cx =
+        srFindIn(&search, chars, row->size, 0, &mlen) - chars;
+    E.activeBuffer->rowoff = E.activeBuffer->numrows;
+  }
+
+  if (current == -1) {
+    return;
+  }
+
+  // The match is scrolled to the top of the screen, so every match from
+  // there to the bottom of the screen is marked.
+  int last = current + E.screenRows;
+
+  if (last > E.activeBuffer->numrows) {
+    last = E.activeBuffer->numrows;
+  }
+
+  editorUpdateSyntaxRange(&E, current, last - 1);
+
+  for (int i = current; i < last; ++i) {
+    erow *row = editorGetRow(E.activeBuffer, i);
+    const char *chars = editorRowChars(row);
+    const char *match;
+    int from = 0;
+    int mlen;
+
+    while (from <= row->size &&
+           (match = srFindIn(&search, chars, row->size, from, &mlen))) {
+      int cx = match - chars;
+      int rx = editorRowCxToRx(row, cx);
+
+      editorAddOverlay(E.activeBuffer, i, rx,
+                       editorRowCxToRx(row, cx + mlen) - rx, HL_MATCH);
+
+      // A pattern can match nothing, and then the next search starts one
+      // byte further on.
+      from = cx + (mlen > 0 ? mlen : 1);
+    }
+  }
+}
+
+void editorFind(int regex) {
+  int saved_cx = E.activeBuffer->cx;
+  int saved_cy = E.activeBuffer->cy;
+  int saved_coloff = E.activeBuffer->coloff;
+  int saved_rowoff = E.activeBuffer->rowoff;
+
+  search.regex = regex;
+
+  char *query = editorPrompt(regex ? "Regex search: %s" : "Search: %s",
+                             editorFindCallback);
+
+  if (query) {
+    free(query);
+  } else {
+    E.activeBuffer->cx = saved_cx;
+    E.activeBuffer->cy = saved_cy;
+    E.activeBuffer->coloff = saved_coloff;
+    E.activeBuffer->rowoff = saved_rowoff;
+  }
+}
+
+/**
+ * Appends the n bytes at s to the text at *text, growing it as needed.
+ */
+static void editorAppendText(char **text, size_t *len, size_t *cap,
+                             const char *s, size_t n) {
+  if (*len + n > *cap) {
+    while (*len + n > *cap) {
+      *cap = *cap ? *cap * 2 : 4096;
+    }
+
+    *text = realloc(*text, *cap);
+
+    if (*text == NULL) {
+      die("realloc");
+    }
+  }
+
+  memcpy(*text + *len, s, n);
+  *len += n;
+}
+
+/**
+ * Searches every open buffer for a query, and lists the rows that match in a
+ * new read-only buffer as file:line: text. Buffers of results are not
+ * searched themselves.
+ */
+void editorSearchBuffers() {
+  char *query = editorPrompt("Search all buffers: %s", NULL);
+
+  if (query == NULL || query[0] == '\0') {
+    free(query);
+    return;
+  }
+
+  buffer_t **buffers = malloc(sizeof(buffer_t *) * E.numBuffers);
+  struct searchState *found = calloc(E.numBuffers, sizeof(*found));
+  int n = 0;
+
+  if (buffers == NULL || found == NULL) {
+    die("malloc");
+  }
+
+  for (int i = 0; i < E.numBuffers; ++i) {
+    if (!E.buffers[i]->results) {
+      buffers[n++] = E.buffers[i];
+    }
+  }
+
+  srSearchBuffers(buffers, n, query, found);
 
-  buffer->linum_width = 0;
-  buffer->linum_mode = 1;
+  int nhits = 0;
+  int nfound = 0;
 
-  buffer->numrows = 0;
-  buffer->row = NULL;
-  buffer->dirty = 0;
+  for (int i = 0; i < n; ++i) {
+    nhits += found[i].nrows;
+    nfound += found[i].nrows > 0;
+  }
 
-  buffer->filename = NULL;
-  buffer->syntax = NULL;
-}
+  struct searchHit *hits = malloc(sizeof(struct searchHit) * (nhits + 1));
+  char *text = NULL;
+  size_t len = 0;
+  size_t cap = 0;
+  int k = 0;
 
-void freeBuffer(buffer_t *buffer) {
-  while (buffer->numrows) {
-    editorDelRow(buffer->conf, buffer->numrows - 1);
+  if (hits == NULL) {
+    die("malloc");
   }
 
-  free(buffer->row);
+  for (int i = 0; i < n; ++i) {
+    const char *name = buffers[i]->filename ? buffers[i]->filename
+                                            : "[No Name]";
 
-  free(buffer->filename);
-}
+    for (int j = 0; j < found[i].nrows; ++j) {
+      struct lineIter it;
+      char prefix[32];
+      int rowlen;
 
-char *editorRowsToString(int *buflen) {
-  int totlen = 0;
-  int j;
+      lsIterInit(&buffers[i]->rows, found[i].rows[j], &it);
 
-  for (j = 0; j < E.activeBuffer->numrows; ++j) {
-    totlen += E.activeBuffer->row[j].size + 1;
-  }
+      const char *s = lsIterNextChars(&it, &rowlen);
+      int plen =
+          snprintf(prefix, sizeof(prefix), ":%d: ", found[i].rows[j] + 1);
 
-  *buflen = totlen;
+      editorAppendText(&text, &len, &cap, name, strlen(name));
+      editorAppendText(&text, &len, &cap, prefix, plen);
+      editorAppendText(&text, &len, &cap, s, rowlen);
+      editorAppendText(&text, &len, &cap, "\n", 1);
 
-  char *buf = malloc(totlen);
-  char *p = buf;
+      hits[k].buffer = buffers[i];
+      hits[k].row = found[i].rows[j];
+      hits[k].namelen = 0;
+      ++k;
+    }
 
-  for (j = 0; j < E.activeBuffer->numrows; ++j) {
-    memcpy(p, E.activeBuffer->row[j].chars, E.activeBuffer->row[j].size);
-    p += E.activeBuffer->row[j].size;
-    *p = '\n';
-    ++p;
+    srFree(&found[i]);
   }
 
-  return buf;
+  editorCreateBuffer(&E, NULL);
+  editorLastBuffer(&E, NULL);
+
+  if (len > 0) {
+    editorLoadRows(E.activeBuffer, text, len);
+  }
+
+  E.activeBuffer->readonly = 1;
+  E.activeBuffer->results = 1;
+  E.activeBuffer->hits = hits;
+  E.activeBuffer->nhits = nhits;
+  E.activeBuffer->hits_cap = nhits + 1;
+
+  editorSetStatusMessage("%d matches of \"%.20s\" in %d of %d buffers", nhits,
+                         query, nfound, n);
+
+  free(text);
+  free(found);
+  free(buffers);
+  free(query);
 }
 
-void editorOpen(char *filename) {
-  if (E.activeBuffer->filename && E.activeBuffer->dirty) {
-    char *response =
-        editorPrompt("Warning! Unsaved changes. Close anyway? y/n: %s", NULL);
+/**
+ * Switches to the buffer and row that the line under the cursor in a buffer
+ * of search results points to.
+ */
+void editorJumpToHit() {
+  buffer_t *results = E.activeBuffer;
 
-    if (!(strcmp(response, "y") == 0 || strcmp(response, "Y") == 0)) {
-      return;
-    }
+  if (results->cy >= results->nhits) {
+    return;
   }
 
-  E.activeBuffer->filename = strdup(filename);
+  struct searchHit *hit = &results->hits[results->cy];
 
-  editorSelectSyntaxHighlight(&E);
+  if (hit->namelen > 0) {
+    erow *row = editorGetRow(results, results->cy);
+    char *filename = strndup(editorRowChars(row), hit->namelen);
 
-  FILE *fp = fopen(filename, "r");
-  if (!fp) {
-    // File did not exist. Create it.
-    fp = fopen(filename, "w");
+    if (filename == NULL) {
+      die("strndup");
+    }
 
-    if (!fp) {
-      // File could not be opened.
-      die("fopen");
+    editorCreateBuffer(&E, NULL);
+    editorLastBuffer(&E, NULL);
+    editorOpen(filename);
+
+    free(filename);
+  } else if (hit->buffer == NULL) {
+    editorSetStatusMessage("The buffer of this match has been closed");
+    return;
+  } else {
+    for (int i = 0; i < E.numBuffers; ++i) {
+      if (E.buffers[i] == hit->buffer) {
+        E.curBuffer = i;
+        E.activeBuffer = hit->buffer;
+        break;
+      }
     }
   }
 
-  char *line = NULL;
-  size_t linecap = 0;
-  ssize_t linelen;
+  // The row may have moved or gone since the search if the buffer or file
+  // has been edited.
+  E.activeBuffer->cy = hit->row < E.activeBuffer->numrows
+                           ? hit->row
+                           : E.activeBuffer->numrows;
+  E.activeBuffer->cx = 0;
+  E.activeBuffer->rowoff = E.activeBuffer->numrows;
+}
 
-  ssize_t bytes_read = 0;
+/**
+ * A grep whose output goes to a buffer. The flusher thread moves the output
+ * into the buffer as it comes in, with the editor state locked. results is
+ * cleared if the buffer is destroyed, and the output is then thrown away.
+ */
+struct editorGrep {
+  struct grepJob job;
+  buffer_t *results;
+  pthread_t flusher;
+};
 
-  while ((linelen = getline(&line, &linecap, fp)) != -1) {
-    bytes_read += linelen;
-    while (linelen > 0 &&
-           (line[linelen - 1] == '\n' || line[linelen - 1] == '\r')) {
-      linelen--;
+/**
+ * Appends a batch of grep output to the end of a buffer of results.
+ */
+static void editorAddGrepOutput(buffer_t *results, const char *text,
+                                size_t len, const struct grepLine *lines,
+                                int n) {
+  if (results->nhits + n > results->hits_cap) {
+    while (results->nhits + n > results->hits_cap) {
+      results->hits_cap = results->hits_cap ? results->hits_cap * 2 : 256;
     }
 
-    editorInsertRow(&E, E.activeBuffer->numrows, line, linelen);
+    results->hits =
+        realloc(results->hits, sizeof(struct searchHit) * results->hits_cap);
+
+    if (results->hits == NULL) {
+      die("realloc");
+    }
   }
 
-  free(line);
-  fclose(fp);
-  E.activeBuffer->dirty = 0;
+  for (int i = 0; i < n; ++i) {
+    struct searchHit *hit = &results->hits[results->nhits + i];
 
-  editorSetStatusMessage("Opened File: %.20s - %d bytes read", filename,
-                         bytes_read);
+    hit->buffer = NULL;
+    hit->row = lines[i].line - 1;
+    hit->namelen = lines[i].namelen;
+  }
+
+  results->nhits += n;
+
+  editorLoadRows(results, text, len);
 }
 
-int editorClose() {
-  while (E.numBuffers) {
-    editorLastBuffer(&E, NULL);
+static void *editorGrepFlusher(void *arg) {
+  struct editorGrep *grep = arg;
 
-    buffer_t *buffer = E.activeBuffer;
+  while (grWait(&grep->job)) {
+    struct grepLine *lines;
+    char *text;
+    size_t len;
+    int n;
 
-    if (buffer->dirty) {
-      char buf[80];
+    grTake(&grep->job, &text, &len, &lines, &n);
 
-      int len = snprintf(
-          buf, sizeof(buf),
-          "Warning! %s contains unsaved changes. Exit anyway? y/n: %%s",
-          buffer->filename ? buffer->filename : "[no name]");
+    pthread_mutex_lock(&E.lock);
 
-      char *response = editorPrompt(buf, NULL);
+    if (grep->results && n > 0) {
+      editorAddGrepOutput(grep->results, text, len, lines, n);
 
-      if (!(strcmp(response, "y") == 0 || strcmp(response, "Y") == 0)) {
-        if (response) {
-          free(response);
-        }
-        return 1;
+      if (E.activeBuffer == grep->results) {
+        editorRequestRedraw();
       }
-
-      free(response);
     }
 
-    editorDestroyBuffer(&E, E.numBuffers - 1);
+    pthread_mutex_unlock(&E.lock);
+
+    free(text);
+    free(lines);
+
+    // Output is let to pile up for a while, so that the screen is not
+    // redrawn for every file with a match.
+    usleep(JDEDIT_GREP_FLUSH_US);
   }
 
-  return 0;
-}
+  pthread_mutex_lock(&E.lock);
 
-void editorSave() {
-  if (E.activeBuffer->filename == NULL) {
-    E.activeBuffer->filename = editorPrompt("Save as: %s", NULL);
+  // A prompt that is open keeps the message bar to itself.
+  if (grep->results) {
+    grep->results->grep = NULL;
 
-    if (E.activeBuffer->filename == NULL) {
-      editorSetStatusMessage("Save Aborted");
-      return;
+    if (!E.prompting) {
+      editorSetStatusMessage("Grep: %d matches in %d files",
+                             grep->job.matches, grep->job.files);
+      editorRequestRedraw();
     }
-
-    editorSelectSyntaxHighlight(&E);
   }
 
-  int len;
-  char *buf = editorRowsToString(&len);
+  pthread_mutex_unlock(&E.lock);
 
-  int fd = open(E.activeBuffer->filename, O_RDWR | O_CREAT, 0644);
-  if (fd != -1) {
-    if (ftruncate(fd, len) != -1) {
-      if (write(fd, buf, len) == len) {
-        close(fd);
-        free(buf);
-        E.activeBuffer->dirty = 0;
-        editorSetStatusMessage("Wrote File: %.20s - %d bytes written",
-                               E.activeBuffer->filename, len);
-        return;
-      }
-    }
-    close(fd);
-  }
+  grFree(&grep->job);
+  free(grep);
 
-  free(buf);
+  return NULL;
+}
 
-  editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+/**
+ * Lets go of a grep whose buffer is destroyed. The grep stops at the next
+ * file, and the flusher frees it once the threads are done.
+ */
+static void editorStopGrep(struct editorGrep *grep) {
+  grep->results = NULL;
+
+  grCancel(&grep->job);
 }
 
-void editorFindCallback(char *query, int key) {
-  static int last_match = -1;
-  static int direction = 1;
+/**
+ * Searches every file under the current directory for a query, and lists the
+ * lines that match in a new read-only buffer as file:line: text. The search
+ * runs in the background, and the buffer fills up as matches are found.
+ * Enter on a line opens the file at the match in a new buffer.
+ */
+void editorGrep() {
+  char *query = editorPrompt("Grep: %s", NULL);
 
-  static int saved_hl_line;
-  static char *saved_hl = NULL;
+  if (query == NULL || query[0] == '\0') {
+    free(query);
+    return;
+  }
 
-  if (saved_hl) {
-    memcpy(E.activeBuffer->row[saved_hl_line].hl, saved_hl,
-           E.activeBuffer->row[saved_hl_line].rsize);
+  struct editorGrep *grep = malloc(sizeof(struct editorGrep));
 
-    free(saved_hl);
-    saved_hl = NULL;
+  if (grep == NULL) {
+    die("malloc");
   }
 
-  if (key == '\r' || key == '\x1b') {
-    last_match = -1;
-    direction = 1;
+  // Failing to start a thread leaves the editor as it was, so that nothing
+  // unsaved is lost over it.
+  if (grStart(&grep->job, ".", query, srIgnoreCase(query, 0)) == -1) {
+    editorSetStatusMessage("Can't grep! No thread could be started");
+    free(grep);
+    free(query);
+    return;
+  }
+
+  int previous = E.curBuffer;
+
+  editorCreateBuffer(&E, NULL);
+  editorLastBuffer(&E, NULL);
+
+  E.activeBuffer->readonly = 1;
+  E.activeBuffer->results = 1;
+
+  grep->results = E.activeBuffer;
 
+  if (pthread_create(&grep->flusher, NULL, editorGrepFlusher, grep) != 0) {
+    grCancel(&grep->job);
+    grFree(&grep->job);
+    free(grep);
+
+    editorDestroyBuffer(&E, E.curBuffer);
+
+    E.curBuffer = previous;
+    E.activeBuffer = E.buffers[previous];
+
+    editorSetStatusMessage("Can't grep! No thread could be started");
+    free(query);
     return;
-  } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
-    direction = 1;
-  } else if (key == ARROW_LEFT || key == ARROW_UP) {
-    direction = -1;
-  } else {
-    last_match = -1;
-    direction = 1;
   }
 
-  if (last_match == -1) {
-    direction = 1;
+  pthread_detach(grep->flusher);
+
+  E.activeBuffer->grep = grep;
+
+  editorSetStatusMessage("Grep: searching for \"%.20s\"", query);
+
+  free(query);
+}
+
+/**
+ * Has the UI thread redraw the screen while it waits for a key.
+ */
+static void editorRequestRedraw() {
+  // A full pipe means that a redraw is pending already.
+  if (write(E.wake[1], "", 1) == -1 && errno != EAGAIN) {
+    die("write");
   }
+}
 
-  int current = last_match;
-  int i;
+/**
+ * Waits for the next key with the editor state unlocked, so that the
+ * highlight worker can use the time. Redraws asked for meanwhile are done
+ * here.
+ */
+static int editorReadKey() {
+  E.idle_epoch++;
+  atomic_store(&E.idle, 1);
 
-  for (i = 0; i < E.activeBuffer->numrows; ++i) {
-    current += direction;
+  pthread_cond_signal(&E.idle_cond);
+  pthread_mutex_unlock(&E.lock);
 
-    if (current == -1) {
-      current = E.activeBuffer->numrows - 1;
-    } else if (current == E.activeBuffer->numrows) {
-      current = 0;
+  while (!terminalWaitKey(E.wake[0])) {
+    char buf[64];
+
+    while (read(E.wake[0], buf, sizeof(buf)) > 0) {
     }
 
-    erow *row = &E.activeBuffer->row[current];
-    char *match = strstr(row->render, query);
+    // The worker gives the lock back after its slice, and goes on once the
+    // screen is drawn.
+    atomic_store(&E.idle, 0);
+    pthread_mutex_lock(&E.lock);
 
-    if (match) {
-      last_match = current;
-      E.activeBuffer->cy = current;
-      E.activeBuffer->cx = editorRowRxToCx(row, match - row->render);
-      E.activeBuffer->rowoff = E.activeBuffer->numrows;
+    editorRefreshScreen();
 
-      saved_hl_line = current;
-      saved_hl = malloc(row->rsize);
-      memcpy(saved_hl, row->hl, row->rsize);
-      memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-      break;
-    }
+    atomic_store(&E.idle, 1);
+    pthread_cond_signal(&E.idle_cond);
+    pthread_mutex_unlock(&E.lock);
   }
-}
 
-void editorFind() {
-  int saved_cx = E.activeBuffer->cx;
-  int saved_cy = E.activeBuffer->cy;
-  int saved_coloff = E.activeBuffer->coloff;
-  int saved_rowoff = E.activeBuffer->rowoff;
+  int c = terminalReadKey();
 
-  char *query = editorPrompt("Search: %s", editorFindCallback);
+  atomic_store(&E.idle, 0);
+  pthread_mutex_lock(&E.lock);
 
-  if (query) {
-    free(query);
-  } else {
-    E.activeBuffer->cx = saved_cx;
-    E.activeBuffer->cy = saved_cy;
-    E.activeBuffer->coloff = saved_coloff;
-    E.activeBuffer->rowoff = saved_rowoff;
-  }
+  return c;
 }
 
 char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
@@ -539,17 +1493,20 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
   size_t buflen = 0;
   buf[0] = '\0';
 
+  E.prompting = 1;
+
   while (1) {
     editorSetStatusMessage(prompt, buf);
     editorRefreshScreen();
 
-    int c = terminalReadKey();
+    int c = editorReadKey();
 
     if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
       if (buflen != 0) {
         buf[--buflen] = '\0';
       }
     } else if (c == '\x1b') {
+      E.prompting = 0;
       editorSetStatusMessage("");
 
       if (callback) {
@@ -560,6 +1517,7 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
       return NULL;
     } else if (c == '\r') {
       if (buflen != 0) {
+        E.prompting = 0;
         editorSetStatusMessage("");
 
         if (callback) {
@@ -586,7 +1544,7 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
 void editorMoveCursor(int key) {
   erow *row = (E.activeBuffer->cy >= E.activeBuffer->numrows)
                   ? NULL
-                  : &E.activeBuffer->row[E.activeBuffer->cy];
+                  : editorGetRow(E.activeBuffer, E.activeBuffer->cy);
 
   switch (key) {
   case ARROW_LEFT:
@@ -594,7 +1552,8 @@ void editorMoveCursor(int key) {
       E.activeBuffer->cx--;
     } else if (E.activeBuffer->cy > 0) {
       E.activeBuffer->cy--;
-      E.activeBuffer->cx = E.activeBuffer->row[E.activeBuffer->cy].size;
+      E.activeBuffer->cx =
+          editorGetRow(E.activeBuffer, E.activeBuffer->cy)->size;
     }
     break;
   case ARROW_RIGHT:
@@ -619,7 +1578,7 @@ void editorMoveCursor(int key) {
 
   row = (E.activeBuffer->cy >= E.activeBuffer->numrows)
             ? NULL
-            : &E.activeBuffer->row[E.activeBuffer->cy];
+            : editorGetRow(E.activeBuffer, E.activeBuffer->cy);
 
   int rowlen = row ? row->size : 0;
   if (E.activeBuffer->cx > rowlen) {
@@ -630,11 +1589,15 @@ void editorMoveCursor(int key) {
 void editorProcessKeypress() {
   int c;
 
-  c = terminalReadKey();
+  c = editorReadKey();
 
   switch (c) {
   case '\r':
-    editorInsertNewline(&E);
+    if (E.activeBuffer->results) {
+      editorJumpToHit();
+    } else {
+      editorInsertNewline(&E);
+    }
     break;
   case CTRL_KEY('q'):
 
@@ -667,6 +1630,22 @@ void editorProcessKeypress() {
     }
   } break;
 
+  case CTRL_KEY('v'): {
+    char *filename = editorPrompt("View file: %s", NULL);
+
+    if (filename) {
+      editorCreateBuffer(&E, NULL);
+      editorLastBuffer(&E, NULL);
+      editorView(filename);
+
+      free(filename);
+    }
+  } break;
+
+  case CTRL_KEY('w'):
+    editorMemoryStats();
+    break;
+
   case CTRL_KEY('a'):
   case HOME_KEY:
     E.activeBuffer->cx = 0;
@@ -674,12 +1653,25 @@ void editorProcessKeypress() {
   case CTRL_KEY('e'):
   case END_KEY:
     if (E.activeBuffer->cy < E.activeBuffer->numrows) {
-      E.activeBuffer->cx = E.activeBuffer->row[E.activeBuffer->cy].size;
+      E.activeBuffer->cx =
+          editorGetRow(E.activeBuffer, E.activeBuffer->cy)->size;
     }
     break;
 
   case CTRL_KEY('s'):
-    editorFind();
+    editorFind(0);
+    break;
+
+  case CTRL_KEY('x'):
+    editorFind(1);
+    break;
+
+  case CTRL_KEY('y'):
+    editorSearchBuffers();
+    break;
+
+  case CTRL_KEY('z'):
+    editorGrep();
     break;
 
   case BACKSPACE:
@@ -772,7 +1764,7 @@ void editorScroll() {
 
   if (E.activeBuffer->cy < E.activeBuffer->numrows) {
     E.activeBuffer->rx = editorRowCxToRx(
-        &E.activeBuffer->row[E.activeBuffer->cy], E.activeBuffer->cx);
+        editorGetRow(E.activeBuffer, E.activeBuffer->cy), E.activeBuffer->cx);
   }
 
   if (E.activeBuffer->cy < E.activeBuffer->rowoff) {
@@ -792,9 +1784,46 @@ void editorScroll() {
   }
 }
 
+/**
+ * Appends a run of rendered text in a single color. Control characters are
+ * shown inverted, after which the color of the run is restored.
+ */
+static void editorDrawText(struct appendBuffer *ab, const char *s, int len,
+                           int color) {
+  int start = 0;
+  int j;
+
+  for (j = 0; j < len; ++j) {
+    if (!iscntrl(s[j])) {
+      continue;
+    }
+
+    char sym = (s[j] <= 26) ? '@' + s[j] : '?';
+
+    abAppend(ab, &s[start], j - start);
+    abAppend(ab, "\x1b[7m", 4);
+    abAppend(ab, &sym, 1);
+    abAppend(ab, "\x1b[m", 3);
+
+    if (color != -1) {
+      char buf[16];
+      int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
+      abAppend(ab, buf, clen);
+    }
+
+    start = j + 1;
+  }
+
+  abAppend(ab, &s[start], len - start);
+}
+
 static void editorDrawRows(struct appendBuffer *ab) {
+  int o = 0;
   int y;
 
+  editorUpdateSyntaxRange(&E, E.activeBuffer->rowoff,
+                          E.activeBuffer->rowoff + E.screenRows - 1);
+
   for (y = 0; y < E.screenRows; ++y) {
     int filerow = y + E.activeBuffer->rowoff;
 
@@ -837,7 +1866,9 @@ static void editorDrawRows(struct appendBuffer *ab) {
         abAppend(ab, "~", 1);
       }
     } else {
-      int len = E.activeBuffer->row[filerow].rsize - E.activeBuffer->coloff;
+      erow *row = editorGetRow(E.activeBuffer, filerow);
+
+      int len = row->rsize - E.activeBuffer->coloff;
 
       if (len < 0) {
         len = 0;
@@ -847,47 +1878,73 @@ static void editorDrawRows(struct appendBuffer *ab) {
         len = E.screenCols;
       }
 
-      char *c = &E.activeBuffer->row[filerow].render[E.activeBuffer->coloff];
-      unsigned char *hl =
-          &E.activeBuffer->row[filerow].hl[E.activeBuffer->coloff];
-      int current_color = -1;
+      int col = E.activeBuffer->coloff;
+      int end = col + len;
+      int k = 0;
 
-      int j;
+      while (o < E.activeBuffer->noverlays &&
+             E.activeBuffer->overlays[o].row < filerow) {
+        ++o;
+      }
 
-      for (j = 0; j < len; ++j) {
-        if (iscntrl(c[j])) {
-          char sym = (c[j] <= 26) ? '@' + c[j] : '?';
+      // The visible part of the row is drawn as runs of one class each, with
+      // one color change per run. Overlays take precedence over the spans
+      // below them.
+      while (col < end) {
+        int next = end;
+        int hl = HL_NORMAL;
 
-          abAppend(ab, "\x1b[7m", 4);
-          abAppend(ab, &sym, 1);
-          abAppend(ab, "\x1b[m", 3);
+        while (k < row->hl_spans && row->hl[k].start + row->hl[k].len <= col) {
+          ++k;
+        }
 
-          if (current_color != -1) {
-            char buf[16];
-            int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
-            abAppend(ab, buf, clen);
-          }
-        } else if (hl[j] == HL_NORMAL) {
-          if (current_color != -1) {
-            abAppend(ab, "\x1b[39m", 5);
-            current_color = -1;
-          }
-          abAppend(ab, &c[j], 1);
-        } else {
-          int color = editorSyntaxToColor(hl[j]);
-
-          if (color != current_color) {
-            current_color = color;
-            char buf[16];
-            int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-            abAppend(ab, buf, clen);
+        if (k < row->hl_spans && row->hl[k].start <= col) {
+          hl = row->hl[k].hl;
+          next = row->hl[k].start + row->hl[k].len;
+        } else if (k < row->hl_spans) {
+          next = row->hl[k].start;
+        }
+
+        while (o < E.activeBuffer->noverlays &&
+               E.activeBuffer->overlays[o].row == filerow &&
+               E.activeBuffer->overlays[o].start +
+                       E.activeBuffer->overlays[o].len <=
+                   col) {
+          ++o;
+        }
+
+        if (o < E.activeBuffer->noverlays &&
+            E.activeBuffer->overlays[o].row == filerow) {
+          struct hlOverlay *overlay = &E.activeBuffer->overlays[o];
+
+          if (overlay->start <= col) {
+            hl = overlay->hl;
+            next = overlay->start + overlay->len;
+          } else if (overlay->start < next) {
+            next = overlay->start;
           }
+        }
 
-          abAppend(ab, &c[j], 1);
+        if (next > end) {
+          next = end;
         }
-      }
 
-      abAppend(ab, "\x1b[39m", 5);
+        int color = hl == HL_NORMAL ? -1 : editorSyntaxToColor(hl);
+
+        if (color != -1) {
+          char buf[16];
+          int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
+          abAppend(ab, buf, clen);
+        }
+
+        editorDrawText(ab, &row->render[col], next - col, color);
+
+        if (color != -1) {
+          abAppend(ab, "\x1b[39m", 5);
+        }
+
+        col = next;
+      }
     }
 
     abAppend(ab, "\x1b[K", 3);
@@ -899,14 +1956,26 @@ static void editorDrawStatusBar(struct appendBuffer *ab) {
   abAppend(ab, "\x1b[7m", 4);
 
   char status[80];
-  char rstatus[80];
+  char rstatus[120];
+  char match[40] = "";
 
   int len = snprintf(
       status, sizeof(status), "%.20s - %d lines %s",
       E.activeBuffer->filename ? E.activeBuffer->filename : "[No Name]",
-      E.activeBuffer->numrows, E.activeBuffer->dirty ? "(modified)" : "");
+      E.activeBuffer->numrows,
+      E.activeBuffer->readonly ? "(read-only)"
+                               : (E.activeBuffer->dirty ? "(modified)" : ""));
+
+  // While searching, the position among the rows with matches is shown.
+  if (search.qlen > 0 && search.current >= 0) {
+    snprintf(match, sizeof(match), "match %d of %d | ", search.current + 1,
+             search.nrows);
+  } else if (search.qlen > 0) {
+    snprintf(match, sizeof(match), "no matches | ");
+  }
 
-  int rlen = snprintf(rstatus, sizeof(rstatus), "%s | L%d/%d | B%d/%d",
+  int rlen = snprintf(rstatus, sizeof(rstatus), "%s%s | L%d/%d | B%d/%d",
+                      match,
                       E.activeBuffer->syntax ? E.activeBuffer->syntax->filetype
                                              : "no ft",
                       E.activeBuffer->cy + 1, E.activeBuffer->numrows,
@@ -941,7 +2010,7 @@ static void editorDrawMessageBar(struct appendBuffer *ab) {
     msglen = E.screenCols + E.activeBuffer->linum_width;
   }
 
-  if (msglen && time(NULL) - E.statusmsg_time < 5) {
+  if (msglen && (E.prompting || time(NULL) - E.statusmsg_time < 5)) {
     abAppend(ab, E.statusmsg, msglen);
   }
 }
@@ -1004,6 +2073,42 @@ void editorSetStatusMessage(const char *fmt, ...) {
   E.statusmsg_time = time(NULL);
 }
 
+//==============================================================================
+// Background highlighting
+//==============================================================================
+
+/**
+ * Walks the highlight frontier of the active buffer while the UI thread waits
+ * for input, one slice at a time, and has the screen redrawn when a row on
+ * screen changed.
+ * Once the walk is done, the worker sleeps until the UI thread has handled
+ * another key.
+ */
+static void *editorSyntaxWorker(void *arg) {
+  editorConfig_t *conf = arg;
+  unsigned int done_epoch = 0;
+
+  pthread_mutex_lock(&conf->lock);
+
+  while (1) {
+    int redraw;
+
+    while (!atomic_load(&conf->idle) || conf->idle_epoch == done_epoch) {
+      pthread_cond_wait(&conf->idle_cond, &conf->lock);
+    }
+
+    if (!editorUpdateSyntaxIdle(conf, &redraw)) {
+      done_epoch = conf->idle_epoch;
+    }
+
+    if (redraw) {
+      editorRequestRedraw();
+    }
+  }
+
+  return NULL;
+}
+
 //==============================================================================
 // Init
 //==============================================================================
@@ -1027,4 +2132,22 @@ void editorInit() {
 
   E.screenRows = E.windowRows - 2;
   E.screenCols = E.windowCols - E.activeBuffer->linum_width;
+
+  if (pipe(E.wake) == -1 || fcntl(E.wake[0], F_SETFL, O_NONBLOCK) == -1 ||
+      fcntl(E.wake[1], F_SETFL, O_NONBLOCK) == -1) {
+    die("pipe");
+  }
+
+  E.prompting = 0;
+
+  pthread_mutex_init(&E.lock, NULL);
+  pthread_cond_init(&E.idle_cond, NULL);
+  atomic_init(&E.idle, 0);
+  E.idle_epoch = 0;
+
+  pthread_mutex_lock(&E.lock);
+
+  if (pthread_create(&E.hl_worker, NULL, editorSyntaxWorker, &E) != 0) {
+    die("pthread_create");
+  }
 }
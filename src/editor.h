@@ -25,15 +25,83 @@
 #ifndef _EDITOR_H
 #define _EDITOR_H
 
+#include "arena.h"
+#include "line_store.h"
 #include "row.h"
 #include "syntax.h"
 
+#include <pthread.h>
+#include <stdatomic.h>
 #include <termios.h>
 #include <time.h>
 
 #define JDEDIT_TAB_STOP 4
 
+/**
+ * Files at least this large are edited in place on top of a mapping instead
+ * of being loaded into memory.
+ */
+#define JDEDIT_MAP_THRESHOLD (64 << 20)
+
+/**
+ * Mapped files at least this large get a trigram index, which narrows down
+ * where a search has to look.
+ */
+#define JDEDIT_INDEX_THRESHOLD (256 << 20)
+
+/**
+ * How far the highlight frontier is walked to reach the rows on screen before
+ * they are highlighted from the recorded states instead, and how many rows it
+ * advances per slice of idle time.
+ */
+#define JDEDIT_HL_SYNC_ROWS 4096
+#define JDEDIT_HL_IDLE_ROWS 4096
+
+/**
+ * Buffers with at least this many rows get their first highlight pass spread
+ * over up to JDEDIT_HL_MAX_THREADS threads. Only loaded files are
+ * highlighted, so this covers the files from this many rows up to
+ * JDEDIT_MAP_THRESHOLD bytes. Mapped files get no syntax, since every
+ * highlighted row would have to own its text, which undoes the mapping.
+ */
+#define JDEDIT_HL_PARALLEL_ROWS 65536
+#define JDEDIT_HL_MAX_THREADS 16
+
+/**
+ * How long grep output is let to pile up between moving it into the buffer
+ * of results and redrawing.
+ */
+#define JDEDIT_GREP_FLUSH_US 50000
+
 struct editorConfig;
+struct mappedFile;
+struct trigramIndex;
+
+/**
+ * A range of a row that is drawn on top of the syntax highlighting, such as a
+ * search match. start and len are in render columns. The overlays of a buffer
+ * are kept sorted by row and start, and never overlap.
+ */
+struct hlOverlay {
+  int row;
+  int start;
+  int len;
+  int hl;
+};
+
+/**
+ * Where a line of a search results buffer points to. That is either a row of
+ * an open buffer, or, when namelen is set, a line of the file named by the
+ * first namelen bytes of the line. buffer is cleared if the buffer is
+ * destroyed.
+ */
+struct searchHit {
+  struct buffer *buffer;
+  int row;
+  int namelen;
+};
+
+struct editorGrep;
 
 typedef struct buffer {
   int cx;
@@ -44,11 +112,25 @@ typedef struct buffer {
   int linum_width;
   int linum_mode;
   int numrows;
-  erow *row;
+  struct arena arena;
+  struct lineStore rows;
+  int hl_frontier;
+  int hl_valid;
+  struct hlOverlay *overlays;
+  int noverlays;
+  int overlays_cap;
   int dirty;
   char *filename;
   struct editorSyntax *syntax;
   struct editorConfig *conf;
+  struct mappedFile *map;
+  struct trigramIndex *index;
+  int readonly;
+  int results;
+  struct searchHit *hits;
+  int nhits;
+  int hits_cap;
+  struct editorGrep *grep;
 } buffer_t;
 
 typedef struct editorConfig {
@@ -65,11 +147,34 @@ typedef struct editorConfig {
   int screenRows;
   int screenCols;
 
-  char statusmsg[80];
+  char statusmsg[128];
   time_t statusmsg_time;
   struct termios orig_termios;
+
+  /**
+   * The editor state belongs to whoever holds lock. The UI thread only lets
+   * go of it while it waits for a key, which is when the highlight worker
+   * gets to walk the frontier. idle is cleared as soon as a key arrives, and
+   * the worker gives the lock back after the slice it is working on.
+   */
+  pthread_mutex_t lock;
+  pthread_cond_t idle_cond;
+  atomic_int idle;
+  unsigned int idle_epoch;
+  pthread_t hl_worker;
+
+  /**
+   * Background threads never draw themselves, since the UI thread may be in
+   * the middle of a prompt. They write to the wake pipe instead, and the UI
+   * thread redraws the screen while it waits for a key. The prompt stays on
+   * the message bar for as long as prompting is set.
+   */
+  int wake[2];
+  int prompting;
 } editorConfig_t;
 
+erow *editorGetRow(buffer_t *buffer, int at);
+erow *editorDetachRow(buffer_t *buffer, int at);
 void editorInsertRow(editorConfig_t *conf, int at, char *s, size_t len);
 void editorDelRow(editorConfig_t *conf, int at);
 void editorInsertChar(editorConfig_t *conf, int c);
@@ -93,12 +198,19 @@ void editorLastBuffer(editorConfig_t *conf, buffer_t **buf_ptr);
 void initBuffer(buffer_t *buffer);
 void freeBuffer(buffer_t *buffer);
 
+void editorClearOverlays(buffer_t *buffer);
+void editorAddOverlay(buffer_t *buffer, int row, int start, int len, int hl);
+
 char *editorRowsToString(int *buflen);
 void editorOpen(char *filename);
+void editorView(char *filename);
 int editorClose();
 void editorSave();
 void editorFindCallback(char *query, int key);
-void editorFind();
+void editorFind(int regex);
+void editorSearchBuffers();
+void editorGrep();
+void editorJumpToHit();
 char *editorPrompt(char *prompt, void (*callback)(char *, int));
 void editorMoveCursor(int key);
 void editorProcessKeypress();
@@ -0,0 +1,480 @@
+/**
+ * @file grep.c
+ * @author Joakim Bertils
+ * @version 0.1
+ * @date 2021-04-18
+ *
+ * @brief Searching the files under a directory.
+ *
+ * @copyright Copyright (C) 2021, Joakim Bertils
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https: //www.gnu.org/licenses/>.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include "grep.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "scan.h"
+
+extern void die(const char *s);
+
+/**
+ * Output from a file is handed over whenever this much has piled up, so
+ * that the matches in a large file show up before it has been searched to
+ * the end.
+ */
+#define GR_FLUSH_BYTES (64 << 10)
+
+/**
+ * Output collected by one thread before it is handed over to the job.
+ */
+struct grepOutput {
+  char *text;
+  size_t textLen;
+  size_t textCap;
+  struct grepLine *lines;
+  int nlines;
+  int linesCap;
+};
+
+static void grAppendText(char **text, size_t *len, size_t *cap,
+                         const char *s, size_t n) {
+  if (*len + n > *cap) {
+    while (*len + n > *cap) {
+      *cap = *cap ? *cap * 2 : 4096;
+    }
+
+    *text = realloc(*text, *cap);
+
+    if (*text == NULL) {
+      die("realloc");
+    }
+  }
+
+  memcpy(*text + *len, s, n);
+  *len += n;
+}
+
+static void grAppendLines(struct grepLine **lines, int *n, int *cap,
+                          const struct grepLine *add, int nadd) {
+  if (*n + nadd > *cap) {
+    while (*n + nadd > *cap) {
+      *cap = *cap ? *cap * 2 : 256;
+    }
+
+    *lines = realloc(*lines, sizeof(struct grepLine) * *cap);
+
+    if (*lines == NULL) {
+      die("realloc");
+    }
+  }
+
+  memcpy(*lines + *n, add, sizeof(struct grepLine) * nadd);
+  *n += nadd;
+}
+
+/**
+ * Hands the output collected by a thread over to the job.
+ */
+static void grFlush(struct grepJob *job, struct grepOutput *out) {
+  if (out->nlines == 0) {
+    return;
+  }
+
+  pthread_mutex_lock(&job->lock);
+
+  grAppendText(&job->text, &job->textLen, &job->textCap, out->text,
+               out->textLen);
+  grAppendLines(&job->lines, &job->nlines, &job->linesCap, out->lines,
+                out->nlines);
+
+  job->matches += out->nlines;
+
+  pthread_cond_signal(&job->output);
+  pthread_mutex_unlock(&job->lock);
+
+  out->textLen = 0;
+  out->nlines = 0;
+}
+
+/**
+ * Pushes entries onto the stack. Must be called with the job locked.
+ */
+static void grPush(struct grepJob *job, struct grepEntry *entries, int n) {
+  if (job->nstack + n > job->stackCap) {
+    while (job->nstack + n > job->stackCap) {
+      job->stackCap = job->stackCap ? job->stackCap * 2 : 256;
+    }
+
+    job->stack = realloc(job->stack, sizeof(struct grepEntry) * job->stackCap);
+
+    if (job->stack == NULL) {
+      die("realloc");
+    }
+  }
+
+  memcpy(job->stack + job->nstack, entries, sizeof(struct grepEntry) * n);
+  job->nstack += n;
+
+  pthread_cond_broadcast(&job->work);
+}
+
+/**
+ * Adds a line of output for the line of the file from start to eol.
+ */
+static void grAddLine(struct grepOutput *out, const char *path, int namelen,
+                      int line, const char *start, const char *eol) {
+  char prefix[32];
+  struct grepLine entry;
+
+  while (eol > start && eol[-1] == '\r') {
+    --eol;
+  }
+
+  if (eol - start > GR_LINE_MAX) {
+    eol = start + GR_LINE_MAX;
+  }
+
+  int plen = snprintf(prefix, sizeof(prefix), ":%d: ", line);
+
+  grAppendText(&out->text, &out->textLen, &out->textCap, path, namelen);
+  grAppendText(&out->text, &out->textLen, &out->textCap, prefix, plen);
+  grAppendText(&out->text, &out->textLen, &out->textCap, start, eol - start);
+  grAppendText(&out->text, &out->textLen, &out->textCap, "\n", 1);
+
+  entry.namelen = namelen;
+  entry.line = line;
+
+  grAppendLines(&out->lines, &out->nlines, &out->linesCap, &entry, 1);
+}
+
+/**
+ * Searches the size bytes of a file at data. Lines are only counted between
+ * matches, in bulk.
+ */
+static void grScan(struct grepJob *job, struct grepOutput *out,
+                   const char *path, const char *data, size_t size) {
+  const char *end = data + size;
+  const char *p = data;
+  const char *counted = data;
+  const char *match;
+  int namelen = strlen(path);
+  int line = 1;
+
+  while (p < end &&
+         (match = scanFind(p, end - p, job->query, job->qlen, job->icase))) {
+    const char *start = memrchr(p, '\n', match - p);
+    const char *eol = memchr(match, '\n', end - match);
+
+    start = start ? start + 1 : p;
+    eol = eol ? eol : end;
+
+    line += scanCount(counted, match - counted, '\n');
+    counted = match;
+
+    grAddLine(out, path, namelen, line, start, eol);
+
+    if (out->textLen >= GR_FLUSH_BYTES) {
+      grFlush(job, out);
+
+      if (atomic_load(&job->cancel)) {
+        break;
+      }
+    }
+
+    p = eol + 1;
+  }
+
+  grFlush(job, out);
+}
+
+static void grSearchFile(struct grepJob *job, struct grepOutput *out,
+                         const char *path) {
+  struct stat st;
+  int fd = open(path, O_RDONLY);
+
+  if (fd == -1) {
+    return;
+  }
+
+  if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+    close(fd);
+    return;
+  }
+
+  char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+  close(fd);
+
+  if (data == MAP_FAILED) {
+    return;
+  }
+
+  madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+  size_t probe = st.st_size < GR_BINARY_PROBE ? st.st_size : GR_BINARY_PROBE;
+
+  if (memchr(data, '\0', probe) == NULL) {
+    grScan(job, out, path, data, st.st_size);
+  }
+
+  munmap(data, st.st_size);
+
+  pthread_mutex_lock(&job->lock);
+  job->files++;
+  pthread_mutex_unlock(&job->lock);
+}
+
+/**
+ * Reads a directory and pushes everything in it onto the stack in one go.
+ */
+static void grReadDir(struct grepJob *job, const char *path) {
+  DIR *dir = opendir(path);
+  struct dirent *ent;
+  struct grepEntry *found = NULL;
+  int nfound = 0;
+  int cap = 0;
+
+  if (dir == NULL) {
+    return;
+  }
+
+  while ((ent = readdir(dir)) != NULL) {
+    if (ent->d_name[0] == '.') {
+      continue;
+    }
+
+    // The root is usually ".", which is left out of the names.
+    size_t len = strlen(path) + strlen(ent->d_name) + 2;
+    char *child = malloc(len);
+
+    if (child == NULL) {
+      die("malloc");
+    }
+
+    if (strcmp(path, ".") == 0) {
+      snprintf(child, len, "%s", ent->d_name);
+    } else {
+      snprintf(child, len, "%s/%s", path, ent->d_name);
+    }
+
+    int type = ent->d_type;
+
+    if (type == DT_UNKNOWN) {
+      struct stat st;
+
+      if (lstat(child, &st) == 0) {
+        type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : 0;
+      }
+    }
+
+    if (type != DT_DIR && type != DT_REG) {
+      free(child);
+      continue;
+    }
+
+    if (nfound == cap) {
+      cap = cap ? cap * 2 : 64;
+      found = realloc(found, sizeof(struct grepEntry) * cap);
+
+      if (found == NULL) {
+        die("realloc");
+      }
+    }
+
+    found[nfound].path = child;
+    found[nfound].dir = type == DT_DIR;
+    ++nfound;
+  }
+
+  closedir(dir);
+
+  if (nfound > 0) {
+    pthread_mutex_lock(&job->lock);
+    grPush(job, found, nfound);
+    pthread_mutex_unlock(&job->lock);
+  }
+
+  free(found);
+}
+
+static void *grWorker(void *arg) {
+  struct grepJob *job = arg;
+  struct grepOutput out;
+
+  memset(&out, 0, sizeof(out));
+
+  pthread_mutex_lock(&job->lock);
+
+  while (1) {
+    // A thread that is busy may still push more work, so the walk is only
+    // over once the stack is empty and nobody is busy.
+    while (job->nstack == 0 && job->busy > 0 && !atomic_load(&job->cancel)) {
+      pthread_cond_wait(&job->work, &job->lock);
+    }
+
+    if (job->nstack == 0 || atomic_load(&job->cancel)) {
+      break;
+    }
+
+    struct grepEntry entry = job->stack[--job->nstack];
+
+    job->busy++;
+    pthread_mutex_unlock(&job->lock);
+
+    if (entry.dir) {
+      grReadDir(job, entry.path);
+    } else {
+      grSearchFile(job, &out, entry.path);
+    }
+
+    free(entry.path);
+
+    pthread_mutex_lock(&job->lock);
+    job->busy--;
+  }
+
+  if (--job->running == 0) {
+    pthread_cond_broadcast(&job->output);
+  }
+
+  pthread_cond_broadcast(&job->work);
+  pthread_mutex_unlock(&job->lock);
+
+  free(out.text);
+  free(out.lines);
+
+  return NULL;
+}
+
+int grStart(struct grepJob *job, const char *root, const char *query,
+            int icase) {
+  struct grepEntry entry;
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+
+  memset(job, 0, sizeof(*job));
+
+  job->query = strdup(query);
+  job->qlen = strlen(query);
+  job->icase = icase;
+
+  entry.path = strdup(root);
+  entry.dir = 1;
+
+  if (job->query == NULL || entry.path == NULL) {
+    die("strdup");
+  }
+
+  pthread_mutex_init(&job->lock, NULL);
+  pthread_cond_init(&job->work, NULL);
+  pthread_cond_init(&job->output, NULL);
+  atomic_init(&job->cancel, 0);
+
+  grPush(job, &entry, 1);
+
+  job->nthreads = cores < GR_MIN_THREADS   ? GR_MIN_THREADS
+                  : cores > GR_MAX_THREADS ? GR_MAX_THREADS
+                                           : cores;
+
+  pthread_mutex_lock(&job->lock);
+
+  for (int i = 0; i < job->nthreads; ++i) {
+    if (pthread_create(&job->threads[i], NULL, grWorker, job) != 0) {
+      job->nthreads = i;
+      break;
+    }
+
+    job->running++;
+  }
+
+  pthread_mutex_unlock(&job->lock);
+
+  if (job->nthreads == 0) {
+    grFree(job);
+    return -1;
+  }
+
+  return 0;
+}
+
+int grWait(struct grepJob *job) {
+  pthread_mutex_lock(&job->lock);
+
+  while (job->nlines == 0 && job->running > 0) {
+    pthread_cond_wait(&job->output, &job->lock);
+  }
+
+  int more = job->nlines > 0 || job->running > 0;
+
+  pthread_mutex_unlock(&job->lock);
+
+  return more;
+}
+
+void grTake(struct grepJob *job, char **text, size_t *len,
+            struct grepLine **lines, int *nlines) {
+  pthread_mutex_lock(&job->lock);
+
+  *text = job->text;
+  *len = job->textLen;
+  *lines = job->lines;
+  *nlines = job->nlines;
+
+  job->text = NULL;
+  job->textLen = 0;
+  job->textCap = 0;
+  job->lines = NULL;
+  job->nlines = 0;
+  job->linesCap = 0;
+
+  pthread_mutex_unlock(&job->lock);
+}
+
+void grCancel(struct grepJob *job) {
+  atomic_store(&job->cancel, 1);
+
+  pthread_mutex_lock(&job->lock);
+  pthread_cond_broadcast(&job->work);
+  pthread_mutex_unlock(&job->lock);
+}
+
+void grFree(struct grepJob *job) {
+  for (int i = 0; i < job->nthreads; ++i) {
+    pthread_join(job->threads[i], NULL);
+  }
+
+  for (int i = 0; i < job->nstack; ++i) {
+    free(job->stack[i].path);
+  }
+
+  free(job->stack);
+  free(job->text);
+  free(job->lines);
+  free(job->query);
+
+  pthread_cond_destroy(&job->output);
+  pthread_cond_destroy(&job->work);
+  pthread_mutex_destroy(&job->lock);
+}
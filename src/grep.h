@@ -0,0 +1,139 @@
+/**
+ * @file grep.h
+ * @author Joakim Bertils
+ * @version 0.1
+ * @date 2021-04-18
+ *
+ * @brief Searching the files under a directory.
+ *
+ * @copyright Copyright (C) 2021, Joakim Bertils
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https: //www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _GREP_H
+#define _GREP_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+/**
+ * The directory tree is walked by this many threads at most. At least
+ * GR_MIN_THREADS are used even on fewer cores, since much of the walk is
+ * spent waiting for the disk.
+ */
+#define GR_MAX_THREADS 16
+#define GR_MIN_THREADS 4
+
+/**
+ * Lines longer than this are cut short in the output.
+ */
+#define GR_LINE_MAX 512
+
+/**
+ * Files with a NUL byte among their first GR_BINARY_PROBE bytes are taken to
+ * be binary and skipped.
+ */
+#define GR_BINARY_PROBE 4096
+
+/**
+ * A directory or file still to visit.
+ */
+struct grepEntry {
+  char *path;
+  int dir;
+};
+
+/**
+ * A line of output. The text of the line is file:line: text, where the file
+ * name is the first namelen bytes.
+ */
+struct grepLine {
+  int namelen;
+  int line;
+};
+
+/**
+ * A search for a string through every regular file under a directory. The
+ * directories and files still to visit are kept on a stack that the threads
+ * take work from and push what they find onto, so the tree is walked and
+ * searched at the same time. Entries whose names start with a dot are
+ * skipped, and symbolic links are not followed.
+ *
+ * The matching lines are collected as text, one line of output per match,
+ * and handed over in batches by grTake while the search goes on.
+ */
+struct grepJob {
+  char *query;
+  int qlen;
+  int icase;
+
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  pthread_cond_t output;
+
+  struct grepEntry *stack;
+  int nstack;
+  int stackCap;
+  int busy;
+  int running;
+
+  char *text;
+  size_t textLen;
+  size_t textCap;
+  struct grepLine *lines;
+  int nlines;
+  int linesCap;
+
+  int files;
+  int matches;
+
+  atomic_int cancel;
+
+  pthread_t threads[GR_MAX_THREADS];
+  int nthreads;
+};
+
+/**
+ * Starts searching the files under root for query. With icase set, letters
+ * match regardless of case. Returns -1 if no thread could be started.
+ */
+int grStart(struct grepJob *job, const char *root, const char *query,
+            int icase);
+
+/**
+ * Waits until there is output that has not been taken, or the search is
+ * done. Returns 0 once the search is done and all output has been taken.
+ */
+int grWait(struct grepJob *job);
+
+/**
+ * Moves the output collected so far to the caller, who frees text and lines
+ * when done with them.
+ */
+void grTake(struct grepJob *job, char **text, size_t *len,
+            struct grepLine **lines, int *nlines);
+
+/**
+ * Makes the threads stop at the next file.
+ */
+void grCancel(struct grepJob *job);
+
+/**
+ * Waits for the threads to finish and frees what the job holds.
+ */
+void grFree(struct grepJob *job);
+
+#endif
@@ -0,0 +1,591 @@
+/**
+ * @file line_store.c
+ * @author Joakim Bertils
+ * @version 0.1
+ * @date 2021-04-18
+ *
+ * @brief Balanced tree holding the rows of a buffer.
+ *
+ * @copyright Copyright (C) 2021, Joakim Bertils
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https: //www.gnu.org/licenses/>.
+ *
+ */
+
+#include "line_store.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "append_buffer.h"
+#include "arena.h"
+#include "mapped_file.h"
+
+#define LS_NODE(r)                                                             \
+  ((struct lineNode *)((char *)(r)-offsetof(struct lineNode, row)))
+
+#define LS_WRITE_CHUNK (1 << 20)
+
+extern void die(const char *s);
+
+static unsigned int lsRandom(struct lineStore *ls) {
+  unsigned int x = ls->seed;
+
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+
+  ls->seed = x;
+
+  return x;
+}
+
+static int lsCount(struct lineNode *node) { return node ? node->count : 0; }
+
+static void lsUpdate(struct lineNode *node) {
+  node->count = lsCount(node->left) + node->lines + lsCount(node->right);
+
+  if (node->left) {
+    node->left->parent = node;
+  }
+
+  if (node->right) {
+    node->right->parent = node;
+  }
+}
+
+static struct lineNode *lsNewNode(struct lineStore *ls) {
+  struct lineNode *node = arAlloc(ls->arena, sizeof(struct lineNode));
+
+  memset(node, 0, sizeof(struct lineNode));
+
+  node->priority = lsRandom(ls);
+  node->count = 1;
+  node->lines = 1;
+  node->owned = 1;
+
+  return node;
+}
+
+static void lsFreeNode(struct lineStore *ls, struct lineNode *node) {
+  if (node->owned) {
+    editorFreeRow(ls->arena, &node->row);
+  }
+
+  arFree(ls->arena, node);
+}
+
+/**
+ * Splits t so that the first k rows end up in l and the rest in r.
+ */
+static void lsSplit(struct lineStore *ls, struct lineNode *t, int k,
+                    struct lineNode **l, struct lineNode **r) {
+  if (!t) {
+    *l = NULL;
+    *r = NULL;
+    return;
+  }
+
+  int left = lsCount(t->left);
+
+  if (k <= left) {
+    lsSplit(ls, t->left, k, l, &t->left);
+    lsUpdate(t);
+    *r = t;
+  } else if (k >= left + t->lines) {
+    lsSplit(ls, t->right, k - left - t->lines, &t->right, r);
+    lsUpdate(t);
+    *l = t;
+  } else {
+    // The cut falls inside a run, so the run is split in two. The tail takes
+    // over the right subtree, and keeping the same priority keeps the heap
+    // order intact.
+    int skip = k - left;
+
+    struct lineNode *tail = lsNewNode(ls);
+
+    tail->priority = t->priority;
+    tail->owned = 0;
+    tail->start = t->start + skip;
+    tail->lines = t->lines - skip;
+    tail->right = t->right;
+
+    t->right = NULL;
+    t->lines = skip;
+
+    lsUpdate(t);
+    lsUpdate(tail);
+
+    *l = t;
+    *r = tail;
+  }
+}
+
+static void lsSplitTree(struct lineStore *ls, struct lineNode *t, int k,
+                        struct lineNode **l, struct lineNode **r) {
+  lsSplit(ls, t, k, l, r);
+
+  if (*l) {
+    (*l)->parent = NULL;
+  }
+
+  if (*r) {
+    (*r)->parent = NULL;
+  }
+}
+
+/**
+ * Joins two trees where every row in a comes before every row in b.
+ */
+static struct lineNode *lsMerge(struct lineNode *a, struct lineNode *b) {
+  if (!a) {
+    return b;
+  }
+
+  if (!b) {
+    return a;
+  }
+
+  if (a->priority > b->priority) {
+    a->right = lsMerge(a->right, b);
+    lsUpdate(a);
+    return a;
+  }
+
+  b->left = lsMerge(a, b->left);
+  lsUpdate(b);
+  return b;
+}
+
+static void lsSetRoot(struct lineStore *ls, struct lineNode *root) {
+  ls->root = root;
+
+  if (root) {
+    root->parent = NULL;
+  }
+}
+
+static struct lineNode *lsFind(struct lineStore *ls, int at, int *offset) {
+  struct lineNode *node = ls->root;
+
+  while (node) {
+    int left = lsCount(node->left);
+
+    if (at < left) {
+      node = node->left;
+    } else if (at < left + node->lines) {
+      *offset = at - left;
+      return node;
+    } else {
+      at -= left + node->lines;
+      node = node->right;
+    }
+  }
+
+  return NULL;
+}
+
+static struct lineNode *lsFirst(struct lineStore *ls) {
+  struct lineNode *node = ls->root;
+
+  while (node && node->left) {
+    node = node->left;
+  }
+
+  return node;
+}
+
+static struct lineNode *lsSuccessor(struct lineNode *node) {
+  if (node->right) {
+    node = node->right;
+
+    while (node->left) {
+      node = node->left;
+    }
+
+    return node;
+  }
+
+  while (node->parent && node->parent->right == node) {
+    node = node->parent;
+  }
+
+  return node->parent;
+}
+
+static struct lineNode *lsPredecessor(struct lineNode *node) {
+  if (node->left) {
+    node = node->left;
+
+    while (node->right) {
+      node = node->right;
+    }
+
+    return node;
+  }
+
+  while (node->parent && node->parent->left == node) {
+    node = node->parent;
+  }
+
+  return node->parent;
+}
+
+static struct lineNode *lsFixup(struct lineNode *node) {
+  if (node) {
+    lsFixup(node->left);
+    lsFixup(node->right);
+    lsUpdate(node);
+  }
+
+  return node;
+}
+
+void lsInit(struct lineStore *ls, struct mappedFile *map,
+            struct arena *arena) {
+  ls->root = NULL;
+  ls->map = map;
+  ls->arena = arena;
+  ls->seed = 0x9e3779b9;
+}
+
+void lsFree(struct lineStore *ls) { ls->root = NULL; }
+
+int lsNumRows(struct lineStore *ls) { return lsCount(ls->root); }
+
+erow *lsGetRow(struct lineStore *ls, int at) {
+  int offset;
+  struct lineNode *node = lsFind(ls, at, &offset);
+
+  if (node->owned) {
+    return &node->row;
+  }
+
+  return mfGetRow(ls->map, node->start + offset);
+}
+
+erow *lsDetachRow(struct lineStore *ls, int at) {
+  int offset;
+  struct lineNode *node = lsFind(ls, at, &offset);
+
+  if (node->owned) {
+    return &node->row;
+  }
+
+  struct lineNode *l;
+  struct lineNode *m;
+  struct lineNode *r;
+
+  lsSplitTree(ls, ls->root, at, &l, &r);
+  lsSplitTree(ls, r, 1, &m, &r);
+
+  // m now covers exactly the one line, so it can take ownership of a copy of
+  // the text without affecting the rest of the run.
+  mfCopyRow(ls->map, m->start, &m->row);
+
+  m->owned = 1;
+
+  lsSetRoot(ls, lsMerge(lsMerge(l, m), r));
+
+  return &m->row;
+}
+
+erow *lsInsertRow(struct lineStore *ls, int at) {
+  struct lineNode *node = lsNewNode(ls);
+  struct lineNode *l;
+  struct lineNode *r;
+
+  lsSplitTree(ls, ls->root, at, &l, &r);
+  lsSetRoot(ls, lsMerge(lsMerge(l, node), r));
+
+  return &node->row;
+}
+
+void lsDelRow(struct lineStore *ls, int at) {
+  struct lineNode *l;
+  struct lineNode *m;
+  struct lineNode *r;
+
+  lsSplitTree(ls, ls->root, at, &l, &r);
+  lsSplitTree(ls, r, 1, &m, &r);
+
+  lsFreeNode(ls, m);
+
+  lsSetRoot(ls, lsMerge(l, r));
+}
+
+erow *lsPrevRow(struct lineStore *ls, erow *row) {
+  struct lineNode *node = lsPredecessor(LS_NODE(row));
+
+  if (!node) {
+    return NULL;
+  }
+
+  if (node->owned) {
+    return &node->row;
+  }
+
+  return mfGetRow(ls->map, node->start + node->lines - 1);
+}
+
+erow *lsNextRow(struct lineStore *ls, erow *row) {
+  struct lineNode *node = lsSuccessor(LS_NODE(row));
+
+  if (!node) {
+    return NULL;
+  }
+
+  if (node->owned) {
+    return &node->row;
+  }
+
+  return mfGetRow(ls->map, node->start);
+}
+
+int lsRowIndex(erow *row) {
+  struct lineNode *node = LS_NODE(row);
+  int at = lsCount(node->left);
+
+  // Every time the path comes up from a right child, the parent and its left
+  // subtree come before the row.
+  for (; node->parent; node = node->parent) {
+    if (node == node->parent->right) {
+      at += lsCount(node->parent->left) + node->parent->lines;
+    }
+  }
+
+  return at;
+}
+
+erow *lsNewRow(struct lineStore *ls) { return &lsNewNode(ls)->row; }
+
+void lsAppendRows(struct lineStore *ls, erow **rows, int n) {
+  if (n == 0) {
+    return;
+  }
+
+  struct lineNode **stack = malloc(sizeof(struct lineNode *) * n);
+  int depth = 0;
+
+  if (!stack) {
+    die("malloc");
+  }
+
+  // The rows are already in order, so the treap can be built in linear time
+  // by keeping the right spine on a stack.
+  for (int i = 0; i < n; ++i) {
+    struct lineNode *node = LS_NODE(rows[i]);
+    struct lineNode *last = NULL;
+
+    while (depth > 0 && stack[depth - 1]->priority < node->priority) {
+      last = stack[--depth];
+    }
+
+    node->left = last;
+    node->right = NULL;
+
+    if (depth > 0) {
+      stack[depth - 1]->right = node;
+    }
+
+    stack[depth++] = node;
+  }
+
+  struct lineNode *tree = lsFixup(stack[0]);
+
+  free(stack);
+
+  lsSetRoot(ls, lsMerge(ls->root, tree));
+}
+
+void lsAppendRun(struct lineStore *ls, int start, int count) {
+  struct lineNode *node = lsNewNode(ls);
+
+  node->owned = 0;
+  node->start = start;
+  node->lines = count;
+  node->count = count;
+
+  lsSetRoot(ls, lsMerge(ls->root, node));
+}
+
+void lsIterInit(struct lineStore *ls, int at, struct lineIter *it) {
+  it->ls = ls;
+  it->offset = 0;
+  it->node = (at < lsNumRows(ls)) ? lsFind(ls, at, &it->offset) : NULL;
+  it->shared = 0;
+}
+
+void lsIterInitShared(struct lineStore *ls, int at, struct lineIter *it) {
+  lsIterInit(ls, at, it);
+
+  it->shared = 1;
+}
+
+erow *lsIterNext(struct lineIter *it) {
+  if (!it->node) {
+    return NULL;
+  }
+
+  erow *row;
+
+  if (it->node->owned) {
+    row = &it->node->row;
+  } else {
+    row = mfGetRow(it->ls->map, it->node->start + it->offset);
+  }
+
+  if (++it->offset == it->node->lines) {
+    it->node = lsSuccessor(it->node);
+    it->offset = 0;
+  }
+
+  return row;
+}
+
+const char *lsIterNextChars(struct lineIter *it, int *len) {
+  if (!it->node) {
+    return NULL;
+  }
+
+  char *s;
+
+  if (it->node->owned) {
+    s = editorRowChars(&it->node->row);
+    *len = it->node->row.size;
+  } else if (it->shared) {
+    mfPeekLine(it->ls->map, it->node->start + it->offset, &s, len);
+  } else {
+    mfGetLine(it->ls->map, it->node->start + it->offset, &s, len);
+  }
+
+  if (++it->offset == it->node->lines) {
+    it->node = lsSuccessor(it->node);
+    it->offset = 0;
+  }
+
+  return s;
+}
+
+/**
+ * Returns how many of the next rows, at most max, are untouched lines in the
+ * current node, or 0 if the next row is not one.
+ */
+static int lsIterRunLength(struct lineIter *it, int max) {
+  if (!it->node || it->node->owned) {
+    return 0;
+  }
+
+  int count = it->node->lines - it->offset;
+
+  return count > max ? max : count;
+}
+
+static void lsIterAdvance(struct lineIter *it, int count) {
+  it->offset += count;
+
+  if (it->offset == it->node->lines) {
+    it->node = lsSuccessor(it->node);
+    it->offset = 0;
+  }
+}
+
+int lsIterNextRun(struct lineIter *it, int max, const char **s, size_t *len) {
+  int count = lsIterRunLength(it, max);
+
+  if (count == 0) {
+    return 0;
+  }
+
+  if (it->shared) {
+    mfPeekLines(it->ls->map, it->node->start + it->offset, count, s, len);
+  } else {
+    mfGetLines(it->ls->map, it->node->start + it->offset, count, s, len);
+  }
+
+  lsIterAdvance(it, count);
+
+  return count;
+}
+
+int lsIterSkipRun(struct lineIter *it, int max) {
+  int count = lsIterRunLength(it, max);
+
+  if (count > 0) {
+    lsIterAdvance(it, count);
+  }
+
+  return count;
+}
+
+int lsIterLine(struct lineIter *it) {
+  if (!it->node || it->node->owned) {
+    return -1;
+  }
+
+  return it->node->start + it->offset;
+}
+
+ssize_t lsWrite(struct lineStore *ls, int fd) {
+  struct appendBuffer ab;
+  ssize_t total = 0;
+  const char *eol = ls->map && ls->map->crlf ? "\r\n" : "\n";
+  int eollen = strlen(eol);
+
+  abInit(&ab);
+
+  // Edited rows are collected and written in larger chunks, while untouched
+  // runs are streamed straight from the mapping.
+  for (struct lineNode *node = lsFirst(ls); node; node = lsSuccessor(node)) {
+    if (node->owned) {
+      abAppend(&ab, editorRowChars(&node->row), node->row.size);
+      abAppend(&ab, eol, eollen);
+
+      if (ab.len < LS_WRITE_CHUNK) {
+        continue;
+      }
+    }
+
+    if (mfWriteAll(fd, ab.b, ab.len) == -1) {
+      abFree(&ab);
+      return -1;
+    }
+
+    total += ab.len;
+
+    abFree(&ab);
+    abInit(&ab);
+
+    if (!node->owned) {
+      ssize_t written = mfWriteLines(ls->map, fd, node->start, node->lines);
+
+      if (written == -1) {
+        return -1;
+      }
+
+      total += written;
+    }
+  }
+
+  if (mfWriteAll(fd, ab.b, ab.len) == -1) {
+    abFree(&ab);
+    return -1;
+  }
+
+  total += ab.len;
+
+  abFree(&ab);
+
+  return total;
+}
@@ -0,0 +1,139 @@
+/**
+ * @file line_store.h
+ * @author Joakim Bertils
+ * @version 0.1
+ * @date 2021-04-18
+ *
+ * @brief Balanced tree holding the rows of a buffer.
+ *
+ * @copyright Copyright (C) 2021, Joakim Bertils
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https: //www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _LINE_STORE_H
+#define _LINE_STORE_H
+
+#include <sys/types.h>
+
+#include "row.h"
+
+struct arena;
+struct mappedFile;
+
+/**
+ * The rows are kept in a treap ordered by position, where every node knows
+ * how many rows its subtree holds. A node is either a single row that owns
+ * its text, or a run of untouched lines in a mapped file.
+ *
+ * Rows do not store their own position. It is implied by where the node sits
+ * in the tree, so inserting or deleting a row never touches its neighbours.
+ */
+struct lineNode {
+  struct lineNode *left;
+  struct lineNode *right;
+  struct lineNode *parent;
+  unsigned int priority;
+  int count;
+  int lines;
+  int start;
+  int owned;
+  erow row;
+};
+
+struct lineStore {
+  struct lineNode *root;
+  struct mappedFile *map;
+  struct arena *arena;
+  unsigned int seed;
+};
+
+struct lineIter {
+  struct lineStore *ls;
+  struct lineNode *node;
+  int offset;
+  int shared;
+};
+
+void lsInit(struct lineStore *ls, struct mappedFile *map, struct arena *arena);
+
+/**
+ * Forgets all rows. The nodes and row payloads are allocated from the arena
+ * given to lsInit, and are only returned when the arena is released.
+ */
+void lsFree(struct lineStore *ls);
+int lsNumRows(struct lineStore *ls);
+
+erow *lsGetRow(struct lineStore *ls, int at);
+erow *lsDetachRow(struct lineStore *ls, int at);
+erow *lsInsertRow(struct lineStore *ls, int at);
+void lsDelRow(struct lineStore *ls, int at);
+
+/**
+ * Neighbour lookups. These only work for rows that the store owns, not for
+ * the transient rows handed out for untouched lines in a mapping.
+ */
+erow *lsPrevRow(struct lineStore *ls, erow *row);
+erow *lsNextRow(struct lineStore *ls, erow *row);
+int lsRowIndex(erow *row);
+
+erow *lsNewRow(struct lineStore *ls);
+void lsAppendRows(struct lineStore *ls, erow **rows, int n);
+void lsAppendRun(struct lineStore *ls, int start, int count);
+
+void lsIterInit(struct lineStore *ls, int at, struct lineIter *it);
+
+/**
+ * Starts an iterator that can run alongside others on other threads, as long
+ * as the rows are not changed meanwhile. Lines in a mapping are then read
+ * without touching the caches of the mapping, so lsIterNext can not be used
+ * with it.
+ */
+void lsIterInitShared(struct lineStore *ls, int at, struct lineIter *it);
+
+erow *lsIterNext(struct lineIter *it);
+
+/**
+ * Like lsIterNext, but only returns the text of the row. Untouched lines in a
+ * mapping are read in place, without building a row for them.
+ */
+const char *lsIterNextChars(struct lineIter *it, int *len);
+
+/**
+ * If the iterator is inside a run of untouched mapped lines, steps over at
+ * most max of them and returns their raw text in one piece, line endings
+ * included. Returns the number of lines stepped over, which is 0 at an owned
+ * row or at the end.
+ */
+int lsIterNextRun(struct lineIter *it, int max, const char **s, size_t *len);
+
+/**
+ * Like lsIterNextRun, but steps over the lines without reading them.
+ */
+int lsIterSkipRun(struct lineIter *it, int max);
+
+/**
+ * Returns the line of the mapping that the next row is, or -1 if the next
+ * row is owned or there is none.
+ */
+int lsIterLine(struct lineIter *it);
+
+/**
+ * Writes all rows to fd. Untouched lines are copied from the mapping as they
+ * are, and edited rows end in the line ending of the first line of the
+ * mapping. Returns the number of bytes written, or -1.
+ */
+ssize_t lsWrite(struct lineStore *ls, int fd);
+
+#endif
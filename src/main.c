@@ -79,7 +79,9 @@ void die(const char *s) {
 int main(int argc, char **argv) {
   terminalEnableRawMode(&E);
   editorInit();
-  if (argc >= 2) {
+  if (argc >= 3 && strcmp(argv[1], "-r") == 0) {
+    editorView(argv[2]);
+  } else if (argc >= 2) {
     editorOpen(argv[1]);
   }
 
@@ -0,0 +1,467 @@
+/**
+ * @file mapped_file.c
+ * @author Joakim Bertils
+ * @version 0.1
+ * @date 2021-04-18
+ *
+ * @brief Memory mapped files with a sparse line index.
+ *
+ * @copyright Copyright (C) 2021, Joakim Bertils
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https: //www.gnu.org/licenses/>.
+ *
+ */
+
+#include "mapped_file.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "scan.h"
+
+#define MF_SCAN_CHUNK (64 << 20)
+
+static size_t mfPageSize() {
+  static size_t pageSize = 0;
+
+  if (pageSize == 0) {
+    pageSize = sysconf(_SC_PAGESIZE);
+  }
+
+  return pageSize;
+}
+
+/**
+ * Hands the pages covering [from, to) back to the kernel. The mapping is
+ * read only, so the data is simply faulted in again from the file if it is
+ * needed later.
+ */
+static void mfDropPages(struct mappedFile *mf, size_t from, size_t to) {
+  size_t page = mfPageSize();
+
+  from = (from / page) * page;
+  to = ((to + page - 1) / page) * page;
+
+  if (to > from) {
+    madvise(mf->data + from, to - from, MADV_DONTNEED);
+  }
+}
+
+/**
+ * Walks the whole file once, counting lines and recording the start of every
+ * MF_INDEX_STRIDE:th line.
+ */
+static int mfBuildIndex(struct mappedFile *mf) {
+  int cap = 1024;
+  long lines = 0;
+
+  mf->index = malloc(sizeof(size_t) * cap);
+
+  if (!mf->index) {
+    return -1;
+  }
+
+  mf->index[0] = 0;
+  mf->indexLen = 1;
+
+  madvise(mf->data, mf->size, MADV_SEQUENTIAL);
+
+  size_t chunk;
+
+  for (chunk = 0; chunk < mf->size; chunk += MF_SCAN_CHUNK) {
+    size_t chunkEnd = chunk + MF_SCAN_CHUNK;
+
+    if (chunkEnd > mf->size) {
+      chunkEnd = mf->size;
+    }
+
+    const char *p = mf->data + chunk;
+    const char *end = mf->data + chunkEnd;
+
+    while ((p = memchr(p, '\n', end - p)) != NULL) {
+      if (lines == 0) {
+        mf->crlf = p > mf->data && p[-1] == '\r';
+      }
+
+      ++p;
+      ++lines;
+
+      if (lines % MF_INDEX_STRIDE == 0) {
+        if (mf->indexLen == cap) {
+          cap *= 2;
+
+          size_t *new = realloc(mf->index, sizeof(size_t) * cap);
+
+          if (!new) {
+            return -1;
+          }
+
+          mf->index = new;
+        }
+
+        mf->index[mf->indexLen++] = p - mf->data;
+      }
+    }
+
+    mfDropPages(mf, chunk, chunkEnd);
+  }
+
+  if (mf->size > 0 && mf->data[mf->size - 1] != '\n') {
+    ++lines;
+  }
+
+  if (lines > INT_MAX) {
+    errno = EFBIG;
+    return -1;
+  }
+
+  mf->numLines = lines;
+
+  madvise(mf->data, mf->size, MADV_RANDOM);
+
+  return 0;
+}
+
+int mfOpen(struct mappedFile *mf, const char *filename, struct arena *arena) {
+  memset(mf, 0, sizeof(*mf));
+
+  mf->arena = arena;
+
+  for (int i = 0; i < MF_CACHE_ROWS; ++i) {
+    mf->cacheLine[i] = -1;
+  }
+
+  int fd = open(filename, O_RDONLY);
+
+  if (fd == -1) {
+    return -1;
+  }
+
+  struct stat st;
+
+  if (fstat(fd, &st) == -1) {
+    close(fd);
+    return -1;
+  }
+
+  if (!S_ISREG(st.st_mode)) {
+    close(fd);
+    errno = EINVAL;
+    return -1;
+  }
+
+  mf->size = st.st_size;
+
+  if (mf->size > 0) {
+    mf->data = mmap(NULL, mf->size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if (mf->data == MAP_FAILED) {
+      mf->data = NULL;
+      close(fd);
+      return -1;
+    }
+  }
+
+  // The mapping keeps its own reference to the file.
+  close(fd);
+
+  if (mfBuildIndex(mf) == -1) {
+    int err = errno;
+    mfClose(mf);
+    errno = err;
+    return -1;
+  }
+
+  return 0;
+}
+
+void mfClose(struct mappedFile *mf) {
+  for (int i = 0; i < MF_CACHE_ROWS; ++i) {
+    if (mf->cache[i].render != mf->cache[i].chars) {
+      arFree(mf->arena, mf->cache[i].render);
+    }
+
+    arFree(mf->arena, mf->cache[i].tabs);
+    arFree(mf->arena, mf->cache[i].hl);
+  }
+
+  free(mf->index);
+
+  if (mf->data) {
+    munmap(mf->data, mf->size);
+  }
+
+  memset(mf, 0, sizeof(*mf));
+}
+
+/**
+ * Skips forward from the given offset of line cur to the start of line.
+ * Past the last line break every line starts at the end of the file, so
+ * running out of line breaks still leaves the right offset for line.
+ */
+static size_t mfSkipLines(const struct mappedFile *mf, size_t offset, int cur,
+                          int line) {
+  if (cur < line) {
+    offset += scanSkip(mf->data + offset, mf->size - offset, '\n', line - cur);
+  }
+
+  return offset;
+}
+
+static int mfIndexEntry(const struct mappedFile *mf, int line) {
+  int entry = line / MF_INDEX_STRIDE;
+
+  return entry < mf->indexLen ? entry : mf->indexLen - 1;
+}
+
+/**
+ * Returns the offset of the first byte of an original line. Line numbers past
+ * the last line map to the end of the file.
+ */
+static size_t mfLineStart(struct mappedFile *mf, int line) {
+  int entry = mfIndexEntry(mf, line);
+  int cur = entry * MF_INDEX_STRIDE;
+  size_t offset = mf->index[entry];
+
+  // Drawing and searching walk the file forwards, so continuing from the
+  // previous lookup is often cheaper than going back to the index.
+  if (line >= mf->lastLine && mf->lastLine > cur) {
+    cur = mf->lastLine;
+    offset = mf->lastOffset;
+  }
+
+  offset = mfSkipLines(mf, offset, cur, line);
+
+  mf->lastLine = line;
+  mf->lastOffset = offset;
+
+  return offset;
+}
+
+/**
+ * Like mfLineStart, but only uses the index, and leaves the mapping as it
+ * is.
+ */
+static size_t mfPeekLineStart(const struct mappedFile *mf, int line) {
+  int entry = mfIndexEntry(mf, line);
+
+  return mfSkipLines(mf, mf->index[entry], entry * MF_INDEX_STRIDE, line);
+}
+
+/**
+ * Notes that [from, to) of the mapping has been looked at. This keeps the
+ * resident part of the mapping bounded to roughly what has been looked at
+ * recently.
+ */
+static void mfTouch(struct mappedFile *mf, size_t from, size_t to) {
+  if (mf->residentHi == mf->residentLo) {
+    mf->residentLo = from;
+    mf->residentHi = to;
+  } else {
+    if (from < mf->residentLo) {
+      mf->residentLo = from;
+    }
+
+    if (to > mf->residentHi) {
+      mf->residentHi = to;
+    }
+  }
+
+  if (mf->residentHi - mf->residentLo > MF_RESIDENT_LIMIT) {
+    if (from > mf->residentLo + mfPageSize()) {
+      mfDropPages(mf, mf->residentLo, from - mfPageSize());
+    }
+
+    if (mf->residentHi > to + mfPageSize()) {
+      mfDropPages(mf, to + mfPageSize(), mf->residentHi);
+    }
+
+    mf->residentLo = from;
+    mf->residentHi = to;
+  }
+}
+
+/**
+ * Returns the line that starts at offset, without its line ending.
+ */
+static void mfLineAt(const struct mappedFile *mf, size_t offset, char **s,
+                     int *len) {
+  const char *end = mf->data + mf->size;
+  const char *start = mf->data + offset;
+  const char *nl = memchr(start, '\n', end - start);
+  const char *eol = nl ? nl : end;
+
+  while (eol > start && eol[-1] == '\r') {
+    --eol;
+  }
+
+  *s = (char *)start;
+  *len = eol - start;
+}
+
+void mfGetLine(struct mappedFile *mf, int line, char **s, int *len) {
+  size_t offset = mfLineStart(mf, line);
+
+  mfLineAt(mf, offset, s, len);
+  mfTouch(mf, offset, offset + *len);
+}
+
+void mfPeekLine(const struct mappedFile *mf, int line, char **s, int *len) {
+  mfLineAt(mf, mfPeekLineStart(mf, line), s, len);
+}
+
+void mfGetLines(struct mappedFile *mf, int line, int count, const char **s,
+                size_t *len) {
+  size_t from = mfLineStart(mf, line);
+  size_t to = mfLineStart(mf, line + count);
+
+  mfTouch(mf, from, to);
+
+  *s = mf->data + from;
+  *len = to - from;
+}
+
+void mfPeekLines(const struct mappedFile *mf, int line, int count,
+                 const char **s, size_t *len) {
+  size_t from = mfPeekLineStart(mf, line);
+  size_t to = mfSkipLines(mf, from, line, line + count);
+
+  *s = mf->data + from;
+  *len = to - from;
+}
+
+void mfRelease(struct mappedFile *mf, const char *s, size_t len) {
+  mfDropPages(mf, s - mf->data, s - mf->data + len);
+}
+
+static void mfMaterializeRow(struct mappedFile *mf, int line, erow *row) {
+  mfGetLine(mf, line, &row->chars, &row->size);
+  row->gap = row->size;
+  row->gap_len = 0;
+  row->tabs = NULL;
+  row->ntabs = -1;
+
+  row->render = NULL;
+  editorUpdateRender(mf->arena, row);
+
+  row->hl = NULL;
+  row->hl_spans = 0;
+  row->hl_entry = 0;
+  row->hl_open_comment = 0;
+  row->stale = 0;
+}
+
+erow *mfGetRow(struct mappedFile *mf, int line) {
+  int slot = line % MF_CACHE_ROWS;
+  erow *row = &mf->cache[slot];
+
+  if (mf->cacheLine[slot] == line) {
+    return row;
+  }
+
+  if (row->render != row->chars) {
+    arFree(mf->arena, row->render);
+  }
+
+  arFree(mf->arena, row->tabs);
+  arFree(mf->arena, row->hl);
+
+  // The row points straight into the mapping. The mapping is read only, so
+  // any attempt to edit it faults instead of silently corrupting the view.
+  mfMaterializeRow(mf, line, row);
+
+  mf->cacheLine[slot] = line;
+
+  return row;
+}
+
+void mfCopyRow(struct mappedFile *mf, int line, erow *row) {
+  mfMaterializeRow(mf, line, row);
+
+  char *chars = arAlloc(mf->arena, row->size + 1);
+
+  memcpy(chars, row->chars, row->size);
+  chars[row->size] = '\0';
+
+  if (row->render == row->chars) {
+    row->render = chars;
+  }
+
+  row->chars = chars;
+}
+
+int mfWriteAll(int fd, const char *s, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, s, len);
+
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      return -1;
+    }
+
+    s += n;
+    len -= n;
+  }
+
+  return 0;
+}
+
+ssize_t mfWriteLines(struct mappedFile *mf, int fd, int start, int count) {
+  ssize_t total = 0;
+
+  // The lines are written straight from the mapping, one chunk at a time so
+  // that they do not pile up in memory.
+  size_t from = mfLineStart(mf, start);
+  size_t to = mfLineStart(mf, start + count);
+
+  while (from < to) {
+    size_t len = to - from;
+
+    if (len > MF_SCAN_CHUNK) {
+      len = MF_SCAN_CHUNK;
+    }
+
+    if (mfWriteAll(fd, mf->data + from, len) == -1) {
+      return -1;
+    }
+
+    mfDropPages(mf, from, from + len);
+
+    from += len;
+    total += len;
+  }
+
+  // Every row ends up terminated, the same as for loaded files.
+  if (total > 0 && to == mf->size && mf->data[to - 1] != '\n') {
+    const char *eol = mf->crlf ? "\r\n" : "\n";
+
+    if (mfWriteAll(fd, eol, strlen(eol)) == -1) {
+      return -1;
+    }
+
+    total += strlen(eol);
+  }
+
+  return total;
+}
@@ -0,0 +1,110 @@
+/**
+ * @file mapped_file.h
+ * @author Joakim Bertils
+ * @version 0.1
+ * @date 2021-04-18
+ *
+ * @brief Memory mapped files with a sparse line index.
+ *
+ * @copyright Copyright (C) 2021, Joakim Bertils
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https: //www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _MAPPED_FILE_H
+#define _MAPPED_FILE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "row.h"
+
+struct arena;
+
+/**
+ * Only every MF_INDEX_STRIDE:th line start is stored in the index. The
+ * remaining lines are found by scanning forward from the closest entry.
+ */
+#define MF_INDEX_STRIDE 1024
+
+/**
+ * Number of materialized rows kept around. Must be larger than the number
+ * of rows that fit on the screen.
+ */
+#define MF_CACHE_ROWS 512
+
+/**
+ * Upper bound on how much of the mapping is allowed to stay resident before
+ * pages outside the current view are handed back to the kernel.
+ */
+#define MF_RESIDENT_LIMIT (64 << 20)
+
+struct mappedFile {
+  char *data;
+  size_t size;
+
+  int numLines;
+
+  /**
+   * Set if the first line of the file ends in CRLF. Rows that are written
+   * anew get the same line ending, while untouched lines keep their own.
+   */
+  int crlf;
+
+  size_t *index;
+  int indexLen;
+
+  int lastLine;
+  size_t lastOffset;
+
+  size_t residentLo;
+  size_t residentHi;
+
+  struct arena *arena;
+
+  erow cache[MF_CACHE_ROWS];
+  int cacheLine[MF_CACHE_ROWS];
+};
+
+int mfOpen(struct mappedFile *mf, const char *filename, struct arena *arena);
+void mfClose(struct mappedFile *mf);
+void mfGetLine(struct mappedFile *mf, int line, char **s, int *len);
+
+/**
+ * Returns the raw text of count lines starting at line, including the line
+ * endings, in one piece.
+ */
+void mfGetLines(struct mappedFile *mf, int line, int count, const char **s,
+                size_t *len);
+
+/**
+ * Like mfGetLine and mfGetLines, but without changing the mapping in any
+ * way, which makes them safe to call from several threads at once. The
+ * caller keeps the resident part of the mapping bounded with mfRelease.
+ */
+void mfPeekLine(const struct mappedFile *mf, int line, char **s, int *len);
+void mfPeekLines(const struct mappedFile *mf, int line, int count,
+                 const char **s, size_t *len);
+
+/**
+ * Hands the pages under len bytes at s, which point into the mapping, back
+ * to the kernel.
+ */
+void mfRelease(struct mappedFile *mf, const char *s, size_t len);
+erow *mfGetRow(struct mappedFile *mf, int line);
+void mfCopyRow(struct mappedFile *mf, int line, erow *row);
+int mfWriteAll(int fd, const char *s, size_t len);
+ssize_t mfWriteLines(struct mappedFile *mf, int fd, int start, int count);
+
+#endif
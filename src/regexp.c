@@ -0,0 +1,836 @@
+/**
+ * @file regexp.c
+ * @author Joakim Bertils
+ * @version 0.1
+ * @date 2021-04-18
+ *
+ * @brief Regular expression matching.
+ *
+ * @copyright Copyright (C) 2021, Joakim Bertils
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https: //www.gnu.org/licenses/>.
+ *
+ */
+
+#include "regexp.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "scan.h"
+
+extern void die(const char *s);
+
+enum reOp { RE_SET = 0, RE_SPLIT, RE_JMP, RE_BOL, RE_EOL, RE_MATCH };
+
+enum reNodeType {
+  RE_N_EMPTY = 0,
+  RE_N_SET,
+  RE_N_CAT,
+  RE_N_ALT,
+  RE_N_STAR,
+  RE_N_PLUS,
+  RE_N_QUEST,
+  RE_N_BOL,
+  RE_N_EOL
+};
+
+#define RE_ACCEPT 1
+#define RE_ACCEPT_END 2
+#define RE_DEAD 4
+#define RE_UNANCHORED 8
+
+#define RE_TABLE_SIZE (RE_CACHE_STATES * 2)
+
+/**
+ * The pattern is parsed into a tree first, since the operators come after
+ * what they apply to, and the program is then generated from the tree.
+ */
+struct reNode {
+  int type;
+  int a;
+  int b;
+};
+
+struct reParser {
+  const char *p;
+  struct reNode *nodes;
+  int nnodes;
+  unsigned char (*sets)[32];
+  int nsets;
+  int icase;
+  int error;
+};
+
+static void *reAlloc(size_t size) {
+  void *p = malloc(size);
+
+  if (p == NULL) {
+    die("malloc");
+  }
+
+  return p;
+}
+
+static int reHas(const unsigned char *set, unsigned char c) {
+  return set[c >> 3] & (1 << (c & 7));
+}
+
+static void reSetAdd(unsigned char *set, unsigned char c) {
+  set[c >> 3] |= 1 << (c & 7);
+}
+
+static void reSetRange(unsigned char *set, int lo, int hi) {
+  for (int c = lo; c <= hi; ++c) {
+    reSetAdd(set, c);
+  }
+}
+
+/**
+ * Adds the other case of every ASCII letter in the set.
+ */
+static void reSetFold(unsigned char *set) {
+  for (int c = 'a'; c <= 'z'; ++c) {
+    if (reHas(set, c) || reHas(set, c - 'a' + 'A')) {
+      reSetAdd(set, c);
+      reSetAdd(set, c - 'a' + 'A');
+    }
+  }
+}
+
+static int reNode(struct reParser *ps, int type, int a, int b) {
+  struct reNode *node = &ps->nodes[ps->nnodes];
+
+  node->type = type;
+  node->a = a;
+  node->b = b;
+
+  return ps->nnodes++;
+}
+
+static unsigned char *reNewSet(struct reParser *ps, int *index) {
+  *index = ps->nsets;
+
+  return memset(ps->sets[ps->nsets++], 0, 32);
+}
+
+/**
+ * Adds the class named by the letter after a backslash, if it is one.
+ */
+static int reAddClass(unsigned char *set, char c) {
+  unsigned char tmp[32] = {0};
+
+  switch (c | 0x20) {
+  case 'd':
+    reSetRange(tmp, '0', '9');
+    break;
+  case 'w':
+    reSetRange(tmp, '0', '9');
+    reSetRange(tmp, 'a', 'z');
+    reSetRange(tmp, 'A', 'Z');
+    reSetAdd(tmp, '_');
+    break;
+  case 's':
+    reSetAdd(tmp, ' ');
+    reSetRange(tmp, '\t', '\r');
+    break;
+  default:
+    return 0;
+  }
+
+  for (int i = 0; i < 32; ++i) {
+    set[i] |= (c >= 'a') ? tmp[i] : (unsigned char)~tmp[i];
+  }
+
+  return 1;
+}
+
+static unsigned char reEscape(char c) {
+  return c == 't' ? '\t' : c;
+}
+
+static int reParseClass(struct reParser *ps) {
+  int index;
+  unsigned char *set = reNewSet(ps, &index);
+  int negate = 0;
+
+  if (*ps->p == '^') {
+    negate = 1;
+    ps->p++;
+  }
+
+  // A ] right at the start is taken literally.
+  const char *first = ps->p;
+
+  while (*ps->p != ']' || ps->p == first) {
+    unsigned char lo = *ps->p++;
+
+    if (lo == '\0') {
+      ps->error = 1;
+      return 0;
+    }
+
+    if (lo == '\\') {
+      if (*ps->p == '\0') {
+        ps->error = 1;
+        return 0;
+      }
+
+      if (reAddClass(set, *ps->p)) {
+        ps->p++;
+        continue;
+      }
+
+      lo = reEscape(*ps->p++);
+    }
+
+    unsigned char hi = lo;
+
+    if (ps->p[0] == '-' && ps->p[1] != ']' && ps->p[1] != '\0') {
+      hi = ps->p[1];
+      ps->p += 2;
+
+      if (hi == '\\') {
+        if (*ps->p == '\0') {
+          ps->error = 1;
+          return 0;
+        }
+
+        hi = reEscape(*ps->p++);
+      }
+
+      if (hi < lo) {
+        ps->error = 1;
+        return 0;
+      }
+    }
+
+    reSetRange(set, lo, hi);
+  }
+
+  ps->p++;
+
+  if (ps->icase) {
+    reSetFold(set);
+  }
+
+  if (negate) {
+    for (int i = 0; i < 32; ++i) {
+      set[i] = ~set[i];
+    }
+  }
+
+  return reNode(ps, RE_N_SET, index, 0);
+}
+
+static int reParseAlt(struct reParser *ps);
+
+static int reParseAtom(struct reParser *ps) {
+  int index;
+  unsigned char *set;
+  unsigned char c = *ps->p++;
+
+  switch (c) {
+  case '(': {
+    int node = reParseAlt(ps);
+
+    if (*ps->p != ')') {
+      ps->error = 1;
+      return 0;
+    }
+
+    ps->p++;
+    return node;
+  }
+  case '[':
+    return reParseClass(ps);
+  case '.':
+    set = reNewSet(ps, &index);
+    memset(set, 0xff, 32);
+    return reNode(ps, RE_N_SET, index, 0);
+  case '^':
+    return reNode(ps, RE_N_BOL, 0, 0);
+  case '$':
+    return reNode(ps, RE_N_EOL, 0, 0);
+  case '*':
+  case '+':
+  case '?':
+    // Nothing to repeat.
+    ps->error = 1;
+    return 0;
+  case '\\':
+    set = reNewSet(ps, &index);
+
+    if (*ps->p == '\0') {
+      ps->error = 1;
+      return 0;
+    }
+
+    if (reAddClass(set, *ps->p)) {
+      ps->p++;
+      return reNode(ps, RE_N_SET, index, 0);
+    }
+
+    c = reEscape(*ps->p++);
+    break;
+  default:
+    set = reNewSet(ps, &index);
+    break;
+  }
+
+  reSetAdd(set, c);
+
+  if (ps->icase) {
+    reSetFold(set);
+  }
+
+  return reNode(ps, RE_N_SET, index, 0);
+}
+
+static int reParseRepeat(struct reParser *ps) {
+  int node = reParseAtom(ps);
+
+  while (!ps->error) {
+    if (*ps->p == '*') {
+      node = reNode(ps, RE_N_STAR, node, 0);
+    } else if (*ps->p == '+') {
+      node = reNode(ps, RE_N_PLUS, node, 0);
+    } else if (*ps->p == '?') {
+      node = reNode(ps, RE_N_QUEST, node, 0);
+    } else {
+      break;
+    }
+
+    ps->p++;
+  }
+
+  return node;
+}
+
+static int reParseCat(struct reParser *ps) {
+  int node = reNode(ps, RE_N_EMPTY, 0, 0);
+  int empty = 1;
+
+  while (!ps->error && *ps->p && *ps->p != '|' && *ps->p != ')') {
+    int next = reParseRepeat(ps);
+
+    node = empty ? next : reNode(ps, RE_N_CAT, node, next);
+    empty = 0;
+  }
+
+  return node;
+}
+
+static int reParseAlt(struct reParser *ps) {
+  int node = reParseCat(ps);
+
+  while (!ps->error && *ps->p == '|') {
+    ps->p++;
+    node = reNode(ps, RE_N_ALT, node, reParseCat(ps));
+  }
+
+  return node;
+}
+
+static int reEmitInst(struct regexp *re, int op, int x, int y) {
+  struct reInst *inst = &re->prog[re->ninst];
+
+  inst->op = op;
+  inst->x = x;
+  inst->y = y;
+
+  return re->ninst++;
+}
+
+static void reEmit(struct regexp *re, struct reNode *nodes, int n) {
+  struct reNode *node = &nodes[n];
+  int at;
+  int jmp;
+
+  switch (node->type) {
+  case RE_N_EMPTY:
+    break;
+  case RE_N_SET:
+    reEmitInst(re, RE_SET, node->a, 0);
+    break;
+  case RE_N_BOL:
+    reEmitInst(re, RE_BOL, 0, 0);
+    break;
+  case RE_N_EOL:
+    reEmitInst(re, RE_EOL, 0, 0);
+    break;
+  case RE_N_CAT:
+    reEmit(re, nodes, node->a);
+    reEmit(re, nodes, node->b);
+    break;
+  case RE_N_ALT:
+    at = reEmitInst(re, RE_SPLIT, re->ninst + 1, 0);
+    reEmit(re, nodes, node->a);
+    jmp = reEmitInst(re, RE_JMP, 0, 0);
+    re->prog[at].y = re->ninst;
+    reEmit(re, nodes, node->b);
+    re->prog[jmp].x = re->ninst;
+    break;
+  case RE_N_STAR:
+    at = reEmitInst(re, RE_SPLIT, re->ninst + 1, 0);
+    reEmit(re, nodes, node->a);
+    reEmitInst(re, RE_JMP, at, 0);
+    re->prog[at].y = re->ninst;
+    break;
+  case RE_N_PLUS:
+    at = re->ninst;
+    reEmit(re, nodes, node->a);
+    reEmitInst(re, RE_SPLIT, at, re->ninst + 1);
+    break;
+  case RE_N_QUEST:
+    at = reEmitInst(re, RE_SPLIT, re->ninst + 1, 0);
+    reEmit(re, nodes, node->a);
+    re->prog[at].y = re->ninst;
+    break;
+  }
+}
+
+/**
+ * Splits the bytes into classes, so that bytes in the same class are in
+ * exactly the same sets of the pattern.
+ */
+static void reBuildClasses(struct regexp *re) {
+  unsigned char boundary[256] = {1};
+  int k = -1;
+
+  for (int s = 0; s < re->nsets; ++s) {
+    for (int c = 1; c < 256; ++c) {
+      if (!reHas(re->sets[s], c) != !reHas(re->sets[s], c - 1)) {
+        boundary[c] = 1;
+      }
+    }
+  }
+
+  for (int c = 0; c < 256; ++c) {
+    if (boundary[c]) {
+      re->reps[++k] = c;
+    }
+
+    re->classes[c] = k;
+  }
+
+  re->nclasses = k + 1;
+}
+
+/**
+ * Returns the byte that a set holds if it holds only one, or a lower case
+ * letter in both cases when icase is set. Returns -1 otherwise.
+ */
+static int reSetLiteral(const unsigned char *set, int icase) {
+  int literal = -1;
+  int n = 0;
+
+  for (int c = 0; c < 256; ++c) {
+    if (reHas(set, c) && n++ == 0) {
+      literal = c;
+    }
+  }
+
+  if (n == 1) {
+    return literal;
+  }
+
+  if (icase && n == 2 && literal >= 'A' && literal <= 'Z' &&
+      reHas(set, literal - 'A' + 'a')) {
+    return literal - 'A' + 'a';
+  }
+
+  return -1;
+}
+
+static void reEndRun(struct regexp *re, const char *run, int *runLen) {
+  if (*runLen > re->mustLen) {
+    memcpy(re->must, run, *runLen);
+    re->mustLen = *runLen;
+  }
+
+  *runLen = 0;
+}
+
+/**
+ * Walks the top level sequence of the pattern and keeps the longest run of
+ * literal bytes in it, which every match has to contain.
+ */
+static void reFindMust(struct regexp *re, struct reNode *nodes, int n,
+                       char *run, int *runLen) {
+  struct reNode *node = &nodes[n];
+  int literal = -1;
+
+  if (node->type == RE_N_CAT) {
+    reFindMust(re, nodes, node->a, run, runLen);
+    reFindMust(re, nodes, node->b, run, runLen);
+    return;
+  }
+
+  if (node->type == RE_N_SET) {
+    literal = reSetLiteral(re->sets[node->a], re->icase);
+  } else if (node->type == RE_N_PLUS && nodes[node->a].type == RE_N_SET) {
+    literal = reSetLiteral(re->sets[nodes[node->a].a], re->icase);
+  }
+
+  if (literal >= 0) {
+    run[(*runLen)++] = literal;
+  }
+
+  // The run goes on only past a single literal byte.
+  if (literal < 0 || node->type != RE_N_SET) {
+    reEndRun(re, run, runLen);
+  }
+}
+
+static void reFlush(struct regexp *re) {
+  re->nstates = 0;
+
+  memset(re->table, 0xff, sizeof(int) * RE_TABLE_SIZE);
+  memset(re->starts, 0xff, sizeof(re->starts));
+}
+
+int reCompile(struct regexp *re, const char *pattern, int icase) {
+  struct reParser ps;
+  int len = strlen(pattern);
+
+  memset(re, 0, sizeof(*re));
+
+  // Every byte of the pattern adds at most three nodes and one set.
+  ps.p = pattern;
+  ps.nodes = reAlloc(sizeof(struct reNode) * (3 * len + 4));
+  ps.nnodes = 0;
+  ps.sets = reAlloc(32 * (len + 1));
+  ps.nsets = 0;
+  ps.icase = icase;
+  ps.error = 0;
+
+  int root = reParseAlt(&ps);
+
+  if (ps.error || *ps.p != '\0') {
+    free(ps.nodes);
+    free(ps.sets);
+    return -1;
+  }
+
+  // Every node becomes at most two instructions.
+  re->prog = reAlloc(sizeof(struct reInst) * (2 * ps.nnodes + 1));
+  re->sets = ps.sets;
+  re->nsets = ps.nsets;
+
+  reEmit(re, ps.nodes, root);
+  reEmitInst(re, RE_MATCH, 0, 0);
+
+  // Texts without the literal are ruled out with scanFind, which is a lot
+  // faster than running the automaton over them.
+  char *run = reAlloc(len + 1);
+  int runLen = 0;
+
+  re->must = reAlloc(len + 1);
+  re->mustLen = 0;
+  re->icase = icase;
+
+  reFindMust(re, ps.nodes, root, run, &runLen);
+  reEndRun(re, run, &runLen);
+
+  free(run);
+  free(ps.nodes);
+
+  reBuildClasses(re);
+
+  re->stateSets = reAlloc(sizeof(int) * RE_CACHE_STATES * re->ninst);
+  re->stateLen = reAlloc(sizeof(int) * RE_CACHE_STATES);
+  re->stateHash = reAlloc(sizeof(unsigned int) * RE_CACHE_STATES);
+  re->stateFlags = reAlloc(RE_CACHE_STATES);
+  re->next = reAlloc(sizeof(int) * RE_CACHE_STATES * re->nclasses);
+  re->table = reAlloc(sizeof(int) * RE_TABLE_SIZE);
+
+  re->stack = reAlloc(sizeof(int) * (2 * re->ninst + 1));
+  re->work = reAlloc(sizeof(int) * re->ninst);
+  re->seen = calloc(re->ninst, sizeof(unsigned int));
+  re->gen = 0;
+
+  if (re->seen == NULL) {
+    die("calloc");
+  }
+
+  reFlush(re);
+
+  return 0;
+}
+
+void reFree(struct regexp *re) {
+  free(re->prog);
+  free(re->sets);
+  free(re->must);
+  free(re->stateSets);
+  free(re->stateLen);
+  free(re->stateHash);
+  free(re->stateFlags);
+  free(re->next);
+  free(re->table);
+  free(re->stack);
+  free(re->work);
+  free(re->seen);
+
+  memset(re, 0, sizeof(*re));
+}
+
+static void reNextGen(struct regexp *re) {
+  if (++re->gen == 0) {
+    memset(re->seen, 0, sizeof(unsigned int) * re->ninst);
+    re->gen = 1;
+  }
+}
+
+/**
+ * Marks the instructions reachable from start without reading a byte. The
+ * assertions are only passed where they hold.
+ */
+static void reClosure(struct regexp *re, int start, int bol, int eol) {
+  int sp = 0;
+
+  re->stack[sp++] = start;
+
+  while (sp > 0) {
+    int i = re->stack[--sp];
+    struct reInst *inst = &re->prog[i];
+
+    if (re->seen[i] == re->gen) {
+      continue;
+    }
+
+    re->seen[i] = re->gen;
+
+    switch (inst->op) {
+    case RE_SPLIT:
+      re->stack[sp++] = inst->y;
+      re->stack[sp++] = inst->x;
+      break;
+    case RE_JMP:
+      re->stack[sp++] = inst->x;
+      break;
+    case RE_BOL:
+      if (bol) {
+        re->stack[sp++] = i + 1;
+      }
+      break;
+    case RE_EOL:
+      if (eol) {
+        re->stack[sp++] = i + 1;
+      }
+      break;
+    }
+  }
+}
+
+/**
+ * Returns the state for the instructions marked in the current generation,
+ * building it if it is not in the cache.
+ */
+static int reAddState(struct regexp *re, int unanchored) {
+  unsigned int hash = unanchored ? 2166136261u : 0;
+  int n = 0;
+
+  // Only the instructions that read a byte or decide a match tell states
+  // apart, the others are always passed through.
+  for (int i = 0; i < re->ninst; ++i) {
+    int op = re->prog[i].op;
+
+    if (re->seen[i] == re->gen &&
+        (op == RE_SET || op == RE_EOL || op == RE_MATCH)) {
+      re->work[n++] = i;
+      hash = (hash ^ i) * 16777619u;
+    }
+  }
+
+  int accept = re->seen[re->ninst - 1] == re->gen;
+  int slot = hash & (RE_TABLE_SIZE - 1);
+
+  for (; re->table[slot] != -1; slot = (slot + 1) & (RE_TABLE_SIZE - 1)) {
+    int d = re->table[slot];
+
+    if (re->stateHash[d] == hash && re->stateLen[d] == n &&
+        !(re->stateFlags[d] & RE_UNANCHORED) == !unanchored &&
+        !memcmp(&re->stateSets[d * re->ninst], re->work, sizeof(int) * n)) {
+      return d;
+    }
+  }
+
+  if (re->nstates == RE_CACHE_STATES) {
+    reFlush(re);
+    slot = hash & (RE_TABLE_SIZE - 1);
+  }
+
+  int d = re->nstates++;
+  int *set = &re->stateSets[d * re->ninst];
+
+  memcpy(set, re->work, sizeof(int) * n);
+
+  re->stateLen[d] = n;
+  re->stateHash[d] = hash;
+  re->stateFlags[d] = (accept ? RE_ACCEPT | RE_ACCEPT_END : 0) |
+                      (n == 0 ? RE_DEAD : 0) |
+                      (unanchored ? RE_UNANCHORED : 0);
+  re->table[slot] = d;
+
+  memset(&re->next[d * re->nclasses], 0xff, sizeof(int) * re->nclasses);
+
+  // Whether the state accepts at the end of the text, where $ holds.
+  if (!accept) {
+    reNextGen(re);
+
+    for (int i = 0; i < n; ++i) {
+      if (re->prog[set[i]].op == RE_EOL) {
+        reClosure(re, set[i] + 1, 0, 1);
+      }
+    }
+
+    if (re->seen[re->ninst - 1] == re->gen) {
+      re->stateFlags[d] |= RE_ACCEPT_END;
+    }
+  }
+
+  return d;
+}
+
+static int reStart(struct regexp *re, int unanchored, int bol) {
+  int *start = &re->starts[unanchored * 2 + bol];
+
+  if (*start < 0) {
+    reNextGen(re);
+    reClosure(re, 0, bol, 0);
+
+    int d = reAddState(re, unanchored);
+
+    // Adding the state may have emptied the cache, starts included.
+    *start = d;
+  }
+
+  return *start;
+}
+
+/**
+ * Builds the transition from state d on class k. The transitions are stored
+ * as offsets into the table, d * nclasses, which saves a multiplication per
+ * byte when following them.
+ */
+static int reStep(struct regexp *re, int d, int k) {
+  unsigned char c = re->reps[k];
+  int unanchored = re->stateFlags[d] & RE_UNANCHORED;
+  int *set = &re->stateSets[d * re->ninst];
+  int before = re->nstates;
+  int next = d;
+
+  // Once a search has found a match, it stays found. This lets the search
+  // loop look at the state only at the end.
+  if (!unanchored || !(re->stateFlags[d] & RE_ACCEPT)) {
+    reNextGen(re);
+
+    for (int i = 0; i < re->stateLen[d]; ++i) {
+      struct reInst *inst = &re->prog[set[i]];
+
+      if (inst->op == RE_SET && reHas(re->sets[inst->x], c)) {
+        reClosure(re, set[i] + 1, 0, 0);
+      }
+    }
+
+    // Searching anywhere in the text is the same as starting a new match at
+    // every position.
+    if (unanchored) {
+      reClosure(re, 0, 0, 0);
+    }
+
+    next = reAddState(re, unanchored);
+  }
+
+  // If the cache was emptied, d is gone, and so is the place to remember
+  // the transition in.
+  if (re->nstates >= before) {
+    re->next[d * re->nclasses + k] = next * re->nclasses;
+  }
+
+  return next;
+}
+
+/**
+ * Returns whether there is a match that starts at or after from.
+ */
+static int reSearchFrom(struct regexp *re, const char *s, int len, int from) {
+  if (re->mustLen > 0 &&
+      !scanFind(s + from, len - from, re->must, re->mustLen, re->icase)) {
+    return 0;
+  }
+
+  const unsigned char *classes = re->classes;
+  int nclasses = re->nclasses;
+  int at = reStart(re, 1, from == 0) * nclasses;
+
+  for (int i = from; i < len; ++i) {
+    int k = classes[(unsigned char)s[i]];
+    int next = re->next[at + k];
+
+    at = next >= 0 ? next : reStep(re, at / nclasses, k) * nclasses;
+  }
+
+  return (re->stateFlags[at / nclasses] & RE_ACCEPT_END) != 0;
+}
+
+int reSearch(struct regexp *re, const char *s, int len) {
+  return reSearchFrom(re, s, len, 0);
+}
+
+/**
+ * Returns the end of the longest match starting at from, or -1 if there is
+ * none.
+ */
+static int reMatchAt(struct regexp *re, const char *s, int len, int from) {
+  int d = reStart(re, 0, from == 0);
+  int end = -1;
+
+  for (int i = from; i < len; ++i) {
+    if (re->stateFlags[d] & RE_ACCEPT) {
+      end = i;
+    }
+
+    int k = re->classes[(unsigned char)s[i]];
+    int next = re->next[d * re->nclasses + k];
+
+    d = next >= 0 ? next / re->nclasses : reStep(re, d, k);
+
+    if (re->stateFlags[d] & RE_DEAD) {
+      return end;
+    }
+  }
+
+  return (re->stateFlags[d] & RE_ACCEPT_END) ? len : end;
+}
+
+const char *reFind(struct regexp *re, const char *s, int len, int from,
+                   int *mlen) {
+  // Most texts do not match at all, which one pass finds out.
+  if (!reSearchFrom(re, s, len, from)) {
+    return NULL;
+  }
+
+  for (; from <= len; ++from) {
+    int end = reMatchAt(re, s, len, from);
+
+    if (end >= 0) {
+      *mlen = end - from;
+      return s + from;
+    }
+  }
+
+  return NULL;
+}
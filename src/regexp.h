@@ -0,0 +1,103 @@
+/**
+ * @file regexp.h
+ * @author Joakim Bertils
+ * @version 0.1
+ * @date 2021-04-18
+ *
+ * @brief Regular expression matching.
+ *
+ * @copyright Copyright (C) 2021, Joakim Bertils
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https: //www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _REGEXP_H
+#define _REGEXP_H
+
+/**
+ * Number of automaton states kept at once. When the cache is full it is
+ * emptied and the states are built again as they are reached.
+ */
+#define RE_CACHE_STATES 256
+
+struct reInst {
+  int op;
+  int x;
+  int y;
+};
+
+/**
+ * A pattern compiled to a program for a Thompson NFA, which is run as a DFA
+ * built lazily from it. The DFA states are sets of NFA states, and are built
+ * the first time they are reached. Bytes that no part of the pattern tells
+ * apart share a class, and the transition tables are indexed by class.
+ *
+ * All memory is allocated by reCompile, so matching never allocates.
+ *
+ * The supported syntax is literals, ., [...] and [^...] classes, the \d, \w
+ * and \s classes and their negations, ^ and $, grouping with (), | and the
+ * *, + and ? operators. The match found is the leftmost, longest one.
+ */
+struct regexp {
+  struct reInst *prog;
+  int ninst;
+
+  unsigned char (*sets)[32];
+  int nsets;
+  int icase;
+
+  char *must;
+  int mustLen;
+
+  unsigned char classes[256];
+  unsigned char reps[256];
+  int nclasses;
+
+  int *stateSets;
+  int *stateLen;
+  unsigned int *stateHash;
+  unsigned char *stateFlags;
+  int *next;
+  int *table;
+  int nstates;
+  int starts[4];
+
+  int *stack;
+  int *work;
+  unsigned int *seen;
+  unsigned int gen;
+};
+
+/**
+ * Compiles pattern. Returns 0 on success and -1 if the pattern is not
+ * valid, in which case nothing has to be freed. With icase set, letters
+ * match regardless of case.
+ */
+int reCompile(struct regexp *re, const char *pattern, int icase);
+void reFree(struct regexp *re);
+
+/**
+ * Returns whether the len bytes at s contain a match.
+ */
+int reSearch(struct regexp *re, const char *s, int len);
+
+/**
+ * Finds the leftmost, longest match in the len bytes at s that starts at or
+ * after from. Returns its start and stores its length in mlen, or returns
+ * NULL if there is none.
+ */
+const char *reFind(struct regexp *re, const char *s, int len, int from,
+                   int *mlen);
+
+#endif
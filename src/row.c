@@ -39,12 +39,221 @@
 
 #include "editor.h"
 
+/** Smallest gap opened when a row runs out of room. */
+#define ROW_MIN_GAP 16
+
+static inline char editorRowCharAt(erow *row, int at) {
+  return at < row->gap ? row->chars[at] : row->chars[at + row->gap_len];
+}
+
+/**
+ * @brief Move the gap so that it starts at the given position.
+ *
+ * Only the characters between the old and the new position are moved.
+ */
+static void editorRowMoveGap(erow *row, int at) {
+  if (at < row->gap) {
+    memmove(&row->chars[at + row->gap_len], &row->chars[at], row->gap - at);
+  } else if (at > row->gap) {
+    memmove(&row->chars[row->gap], &row->chars[row->gap + row->gap_len],
+            at - row->gap);
+  }
+
+  row->gap = at;
+}
+
+/**
+ * @brief Make sure the gap can hold at least len more characters.
+ *
+ * The gap grows with the row, so that a run of insertions reallocates only a
+ * logarithmic number of times.
+ */
+static void editorRowReserve(struct arena *ar, erow *row, size_t len) {
+  if ((size_t)row->gap_len >= len) {
+    return;
+  }
+
+  size_t gap_len = row->size / 2;
+
+  if (gap_len < len) {
+    gap_len = len;
+  }
+
+  if (gap_len < ROW_MIN_GAP) {
+    gap_len = ROW_MIN_GAP;
+  }
+
+  int tail = row->size - row->gap;
+
+  // A render that shares the characters would be left dangling. The row is
+  // about to be edited anyway, so it is rebuilt later.
+  if (row->render == row->chars) {
+    row->render = NULL;
+  }
+
+  row->chars = arRealloc(ar, row->chars, row->size + gap_len + 1);
+
+  // Move the text after the gap, including the terminating byte, to the end
+  // of the new allocation.
+  memmove(&row->chars[row->gap + gap_len],
+          &row->chars[row->gap + row->gap_len], tail + 1);
+
+  row->gap_len = gap_len;
+}
+
+char *editorRowChars(erow *row) {
+  if (row->gap < row->size) {
+    editorRowMoveGap(row, row->size);
+  }
+
+  // Rows served from a mapped file have no gap and must not be written to.
+  if (row->gap_len > 0) {
+    row->chars[row->size] = '\0';
+  }
+
+  return row->chars;
+}
+
+static int editorTabWidth(int rx) {
+  return JDEDIT_TAB_STOP - (rx % JDEDIT_TAB_STOP);
+}
+
+/**
+ * Returns the number of tabs before the given position in chars.
+ */
+static int editorRowTabsBefore(erow *row, int cx) {
+  int lo = 0;
+  int hi = row->ntabs;
+
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+
+    if (row->tabs[mid].cx < cx) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  return lo;
+}
+
+/**
+ * Recomputes the render columns of the tabs from index k onwards, after the
+ * text in front of them has changed.
+ */
+static void editorRowTabsFix(erow *row, int k) {
+  for (; k < row->ntabs; ++k) {
+    struct tabStop *t = &row->tabs[k];
+
+    if (k == 0) {
+      t->rx = t->cx;
+    } else {
+      struct tabStop *prev = &row->tabs[k - 1];
+
+      t->rx = prev->rx + editorTabWidth(prev->rx) + (t->cx - prev->cx - 1);
+    }
+  }
+}
+
+static void editorRowTabsBuild(struct arena *ar, erow *row) {
+  const char *spans[2] = {row->chars, &row->chars[row->gap + row->gap_len]};
+  int lens[2] = {row->gap, row->size - row->gap};
+  int offsets[2] = {0, row->gap};
+  int count = 0;
+
+  int s;
+  int j;
+
+  for (s = 0; s < 2; ++s) {
+    for (j = 0; j < lens[s]; ++j) {
+      if (spans[s][j] == '\t') {
+        ++count;
+      }
+    }
+  }
+
+  arFree(ar, row->tabs);
+  row->tabs = NULL;
+  row->ntabs = 0;
+
+  if (count == 0) {
+    return;
+  }
+
+  row->tabs = arAlloc(ar, sizeof(struct tabStop) * count);
+
+  for (s = 0; s < 2; ++s) {
+    for (j = 0; j < lens[s]; ++j) {
+      if (spans[s][j] == '\t') {
+        row->tabs[row->ntabs++].cx = offsets[s] + j;
+      }
+    }
+  }
+
+  editorRowTabsFix(row, 0);
+}
+
+/**
+ * Updates the tab index after a single character was inserted at or deleted
+ * from the given position.
+ */
+static void editorRowTabsEdit(struct arena *ar, erow *row, int at, int delta,
+                              int tab) {
+  if (row->ntabs < 0) {
+    return;
+  }
+
+  int k = editorRowTabsBefore(row, at);
+  int j;
+
+  if (tab && delta > 0) {
+    row->tabs =
+        arRealloc(ar, row->tabs, sizeof(struct tabStop) * (row->ntabs + 1));
+
+    memmove(&row->tabs[k + 1], &row->tabs[k],
+            sizeof(struct tabStop) * (row->ntabs - k));
+
+    row->tabs[k].cx = at;
+    row->ntabs++;
+
+    j = k + 1;
+  } else if (tab) {
+    memmove(&row->tabs[k], &row->tabs[k + 1],
+            sizeof(struct tabStop) * (row->ntabs - k - 1));
+
+    row->ntabs--;
+
+    j = k;
+  } else {
+    j = k;
+  }
+
+  for (; j < row->ntabs; ++j) {
+    row->tabs[j].cx += delta;
+  }
+
+  editorRowTabsFix(row, k);
+}
+
 int editorRowCxToRx(erow *row, int cx) {
+  if (row->ntabs >= 0) {
+    int k = editorRowTabsBefore(row, cx);
+
+    if (k == 0) {
+      return cx;
+    }
+
+    struct tabStop *t = &row->tabs[k - 1];
+
+    return t->rx + editorTabWidth(t->rx) + (cx - t->cx - 1);
+  }
+
   int rx = 0;
   int j;
 
   for (j = 0; j < cx; ++j) {
-    if (row->chars[j] == '\t') {
+    if (editorRowCharAt(row, j) == '\t') {
       rx += (JDEDIT_TAB_STOP - 1) - (rx % JDEDIT_TAB_STOP);
     }
 
@@ -55,11 +264,37 @@ int editorRowCxToRx(erow *row, int cx) {
 }
 
 int editorRowRxToCx(erow *row, int rx) {
+  if (row->ntabs >= 0) {
+    int lo = 0;
+    int hi = row->ntabs;
+    int cx = rx;
+
+    // Find the last tab starting at or before rx.
+    while (lo < hi) {
+      int mid = lo + (hi - lo) / 2;
+
+      if (row->tabs[mid].rx <= rx) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+
+    if (lo > 0) {
+      struct tabStop *t = &row->tabs[lo - 1];
+      int tab_end = t->rx + editorTabWidth(t->rx);
+
+      cx = rx < tab_end ? t->cx : t->cx + 1 + (rx - tab_end);
+    }
+
+    return cx < row->size ? cx : row->size;
+  }
+
   int cur_rx = 0;
   int cx;
 
   for (cx = 0; cx < row->size; ++cx) {
-    if (row->chars[cx] == '\t') {
+    if (editorRowCharAt(row, cx) == '\t') {
       cur_rx += (JDEDIT_TAB_STOP - 1) - (cur_rx % JDEDIT_TAB_STOP);
     }
 
@@ -73,42 +308,67 @@ int editorRowRxToCx(erow *row, int rx) {
   return cx;
 }
 
-void editorUpdateRow(editorConfig_t *conf, erow *row) {
-  int tabs = 0;
+void editorUpdateRender(struct arena *ar, erow *row) {
+  // The two halves of the gap buffer are rendered in turn, so that the gap
+  // can stay where the cursor is.
+  const char *spans[2] = {row->chars, &row->chars[row->gap + row->gap_len]};
+  int lens[2] = {row->gap, row->size - row->gap};
 
+  int s;
   int j;
   int idx = 0;
 
-  for (j = 0; j < row->size; ++j) {
-    if (row->chars[j] == '\t') {
-      ++tabs;
-    }
+  if (row->ntabs < 0) {
+    editorRowTabsBuild(ar, row);
   }
 
-  free(row->render);
-  row->render = malloc(row->size + tabs * (JDEDIT_TAB_STOP - 1) + 1);
+  int tabs = row->ntabs;
 
-  for (j = 0; j < row->size; ++j) {
-    if (row->chars[j] == '\t') {
-      row->render[idx++] = ' ';
-      while (idx % JDEDIT_TAB_STOP != 0) {
+  if (row->render != row->chars) {
+    arFree(ar, row->render);
+  }
+
+  // Without tabs the render is identical to the characters, so the row just
+  // shares them instead of keeping a second copy.
+  if (tabs == 0) {
+    row->render = editorRowChars(row);
+    row->rsize = row->size;
+    return;
+  }
+
+  row->render = arAlloc(ar, row->size + tabs * (JDEDIT_TAB_STOP - 1) + 1);
+
+  for (s = 0; s < 2; ++s) {
+    for (j = 0; j < lens[s]; ++j) {
+      if (spans[s][j] == '\t') {
         row->render[idx++] = ' ';
+        while (idx % JDEDIT_TAB_STOP != 0) {
+          row->render[idx++] = ' ';
+        }
+      } else {
+        row->render[idx++] = spans[s][j];
       }
-    } else {
-      row->render[idx++] = row->chars[j];
     }
   }
 
   row->render[idx] = '\0';
   row->rsize = idx;
+}
 
-  editorUpdateSyntax(conf, row);
+void editorUpdateRow(editorConfig_t *conf, erow *row) {
+  // Nothing is rebuilt until the row is actually looked at.
+  row->stale = 1;
+  editorInvalidateSyntax(conf, lsRowIndex(row), 0);
 }
 
-void editorFreeRow(erow *row) {
-  free(row->render);
-  free(row->chars);
-  free(row->hl);
+void editorFreeRow(struct arena *ar, erow *row) {
+  if (row->render != row->chars) {
+    arFree(ar, row->render);
+  }
+
+  arFree(ar, row->chars);
+  arFree(ar, row->tabs);
+  arFree(ar, row->hl);
 }
 
 void editorRowInsertChar(editorConfig_t *conf, erow *row, int at, int c) {
@@ -116,22 +376,33 @@ void editorRowInsertChar(editorConfig_t *conf, erow *row, int at, int c) {
     at = row->size;
   }
 
-  row->chars = realloc(row->chars, row->size + 2);
-
-  memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
+  editorRowReserve(&conf->activeBuffer->arena, row, 1);
+  editorRowMoveGap(row, at);
 
+  row->chars[row->gap++] = c;
+  row->gap_len--;
   ++row->size;
-  row->chars[at] = c;
+
+  editorRowTabsEdit(&conf->activeBuffer->arena, row, at, 1, c == '\t');
+
   editorUpdateRow(conf, row);
   conf->activeBuffer->dirty++;
 }
 
 void editorRowAppendString(editorConfig_t *conf, erow *row, char *s,
                            size_t len) {
-  row->chars = realloc(row->chars, row->size + len + 1);
-  memcpy(&row->chars[row->size], s, len);
+  editorRowReserve(&conf->activeBuffer->arena, row, len);
+  editorRowMoveGap(row, row->size);
+
+  memcpy(&row->chars[row->gap], s, len);
+  row->gap += len;
+  row->gap_len -= len;
   row->size += len;
-  row->chars[row->size] = '\0';
+
+  if (row->ntabs >= 0 && memchr(s, '\t', len)) {
+    editorRowTabsBuild(&conf->activeBuffer->arena, row);
+  }
+
   editorUpdateRow(conf, row);
   conf->activeBuffer->dirty++;
 }
@@ -141,8 +412,36 @@ void editorRowDelChar(editorConfig_t *conf, erow *row, int at) {
     return;
   }
 
-  memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
+  // Deleting the character just before the gap only widens the gap, which
+  // is the common case when backspacing over freshly typed text.
+  editorRowMoveGap(row, at + 1);
+
+  int tab = row->chars[at] == '\t';
+
+  row->gap--;
+  row->gap_len++;
   row->size--;
+
+  editorRowTabsEdit(&conf->activeBuffer->arena, row, at, -1, tab);
+
+  editorUpdateRow(conf, row);
+  conf->activeBuffer->dirty++;
+}
+
+void editorRowTruncate(editorConfig_t *conf, erow *row, int at) {
+  if (at < 0 || at > row->size) {
+    return;
+  }
+
+  editorRowMoveGap(row, at);
+
+  row->gap_len += row->size - at;
+  row->size = at;
+
+  if (row->ntabs > 0) {
+    row->ntabs = editorRowTabsBefore(row, at);
+  }
+
   editorUpdateRow(conf, row);
   conf->activeBuffer->dirty++;
 }
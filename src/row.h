@@ -28,25 +28,71 @@
 #include <sys/types.h>
 
 typedef struct editorConfig editorConfig_t;
+struct arena;
 
+/**
+ * A run of rendered characters sharing the same highlight class. Characters
+ * not covered by any span are HL_NORMAL.
+ */
+struct hlSpan {
+  int start;
+  int len;
+  int hl;
+};
+
+/**
+ * Position of a tab in a row, both as an index into chars and as the column it
+ * starts at in the render.
+ */
+struct tabStop {
+  int cx;
+  int rx;
+};
+
+/**
+ * The characters of a row live in a gap buffer: the text before the gap is
+ * stored at chars[0, gap), the text after it at chars[gap + gap_len,
+ * size + gap_len). Consecutive edits at the same place only move the gap
+ * boundaries instead of shifting the whole line.
+ *
+ * The render and hl arrays are built lazily. A stale row has to go through
+ * editorUpdateSyntaxRange before they can be used. Rows without tabs share
+ * their characters as render, so render is only valid for rsize bytes and is
+ * not necessarily NUL terminated. hl_entry is the state the row was last
+ * highlighted in, or -1 if it has not been highlighted.
+ *
+ * The tabs of a row are indexed so that cursor and render columns can be
+ * converted without scanning the row. The index is kept up to date by the
+ * edit functions. An ntabs of -1 means that it has not been built yet.
+ */
 typedef struct erow {
-  int idx;
   int size;
   int rsize;
   char *chars;
+  int gap;
+  int gap_len;
+  struct tabStop *tabs;
+  int ntabs;
   char *render;
-  unsigned char *hl;
+  struct hlSpan *hl;
+  int hl_spans;
+  int hl_entry;
   int hl_open_comment;
+  int stale;
 } erow;
 
 int editorRowCxToRx(erow *row, int cx);
 int editorRowRxToCx(erow *row, int rx);
 
+char *editorRowChars(erow *row);
+
+void editorUpdateRender(struct arena *ar, erow *row);
 void editorUpdateRow(editorConfig_t *conf, erow *row);
-void editorFreeRow(erow *row);
+void editorFreeRow(struct arena *ar, erow *row);
 void editorRowInsertChar(editorConfig_t *conf, erow *row, int at, int c);
 void editorRowAppendString(editorConfig_t *conf, erow *row, char *s,
                            size_t len);
 void editorRowDelChar(editorConfig_t *conf, erow *row, int at);
+void editorRowTruncate(editorConfig_t *conf, erow *row, int at);
 
 #endif
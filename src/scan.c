@@ -0,0 +1,444 @@
+/**
+ * @file scan.c
+ * @author Joakim Bertils
+ * @version 0.1
+ * @date 2021-04-18
+ *
+ * @brief Vectorized byte scanning.
+ *
+ * @copyright Copyright (C) 2021, Joakim Bertils
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https: //www.gnu.org/licenses/>.
+ *
+ */
+
+#include "scan.h"
+
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define SCAN_AVX2 1
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if SCAN_AVX2
+/**
+ * The AVX2 kernels are compiled for AVX2 whatever the rest of the build
+ * targets, and only called when the CPU turns out to have it. Every CPU with
+ * AVX2 also has popcnt.
+ */
+#define SCAN_TARGET_AVX2 __attribute__((target("avx2,popcnt")))
+
+static inline int scanHasAvx2(void) {
+#if defined(__AVX2__)
+  return 1;
+#else
+  return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+/**
+ * Counts the set bits of a block mask. Without the popcnt instruction the
+ * builtin turns into a library call, which is slower than doing it by hand.
+ */
+static inline int scanPopcount(unsigned int mask) {
+#if defined(__POPCNT__)
+  return __builtin_popcount(mask);
+#else
+  mask = mask - ((mask >> 1) & 0x55555555);
+  mask = (mask & 0x33333333) + ((mask >> 2) & 0x33333333);
+  mask = (mask + (mask >> 4)) & 0x0f0f0f0f;
+
+  return (mask * 0x01010101) >> 24;
+#endif
+}
+
+/**
+ * What is left of scanForAny after the last full block, from i on.
+ */
+static int scanForAnyTail(const char *s, int len, const unsigned char *set,
+                          int n, int i) {
+  for (; i < len; ++i) {
+    for (int k = 0; k < n; ++k) {
+      if ((unsigned char)s[i] == set[k]) {
+        return i;
+      }
+    }
+  }
+
+  return len;
+}
+
+#if SCAN_AVX2
+SCAN_TARGET_AVX2
+static int scanForAnyAvx2(const char *s, int len, const unsigned char *set,
+                          int n) {
+  __m256i needles[SCAN_MAX_SET];
+  int i = 0;
+
+  for (int k = 0; k < n; ++k) {
+    needles[k] = _mm256_set1_epi8(set[k]);
+  }
+
+  for (; i + 32 <= len; i += 32) {
+    __m256i block = _mm256_loadu_si256((const __m256i *)&s[i]);
+    __m256i hits = _mm256_setzero_si256();
+
+    for (int k = 0; k < n; ++k) {
+      hits = _mm256_or_si256(hits, _mm256_cmpeq_epi8(block, needles[k]));
+    }
+
+    unsigned int mask = _mm256_movemask_epi8(hits);
+
+    if (mask) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+
+  return scanForAnyTail(s, len, set, n, i);
+}
+#endif
+
+int scanForAny(const char *s, int len, const unsigned char *set, int n) {
+  int i = 0;
+
+#if SCAN_AVX2
+  if (scanHasAvx2()) {
+    return scanForAnyAvx2(s, len, set, n);
+  }
+#endif
+
+#if defined(__SSE2__)
+  __m128i needles[SCAN_MAX_SET];
+
+  for (int k = 0; k < n; ++k) {
+    needles[k] = _mm_set1_epi8(set[k]);
+  }
+
+  for (; i + 16 <= len; i += 16) {
+    __m128i block = _mm_loadu_si128((const __m128i *)&s[i]);
+    __m128i hits = _mm_setzero_si128();
+
+    for (int k = 0; k < n; ++k) {
+      hits = _mm_or_si128(hits, _mm_cmpeq_epi8(block, needles[k]));
+    }
+
+    unsigned int mask = _mm_movemask_epi8(hits);
+
+    if (mask) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+#endif
+
+  return scanForAnyTail(s, len, set, n, i);
+}
+
+#if SCAN_AVX2
+SCAN_TARGET_AVX2
+static size_t scanCountAvx2(const char *s, size_t len, unsigned char c) {
+  __m256i needle = _mm256_set1_epi8(c);
+  size_t count = 0;
+  size_t i = 0;
+
+  for (; i + 32 <= len; i += 32) {
+    __m256i block = _mm256_loadu_si256((const __m256i *)&s[i]);
+    unsigned int mask =
+        _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, needle));
+
+    count += __builtin_popcount(mask);
+  }
+
+  for (; i < len; ++i) {
+    count += (unsigned char)s[i] == c;
+  }
+
+  return count;
+}
+#endif
+
+size_t scanCount(const char *s, size_t len, unsigned char c) {
+  size_t count = 0;
+  size_t i = 0;
+
+#if SCAN_AVX2
+  if (scanHasAvx2()) {
+    return scanCountAvx2(s, len, c);
+  }
+#endif
+
+#if defined(__SSE2__)
+  __m128i needle = _mm_set1_epi8(c);
+
+  for (; i + 16 <= len; i += 16) {
+    __m128i block = _mm_loadu_si128((const __m128i *)&s[i]);
+    unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, needle));
+
+    count += scanPopcount(mask);
+  }
+#endif
+
+  for (; i < len; ++i) {
+    count += (unsigned char)s[i] == c;
+  }
+
+  return count;
+}
+
+/**
+ * What is left of scanSkip after the last full block, from i on, with n of
+ * the bytes still to go.
+ */
+static size_t scanSkipTail(const char *s, size_t len, unsigned char c,
+                           size_t n, size_t i) {
+  for (; i < len; ++i) {
+    const char *p = memchr(&s[i], c, len - i);
+
+    if (!p) {
+      break;
+    }
+
+    i = p - s;
+
+    if (--n == 0) {
+      return i + 1;
+    }
+  }
+
+  return len;
+}
+
+#if SCAN_AVX2
+SCAN_TARGET_AVX2
+static size_t scanSkipAvx2(const char *s, size_t len, unsigned char c,
+                           size_t n) {
+  __m256i needle = _mm256_set1_epi8(c);
+  size_t i = 0;
+
+  for (; i + 32 <= len; i += 32) {
+    __m256i block = _mm256_loadu_si256((const __m256i *)&s[i]);
+    unsigned int mask =
+        _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, needle));
+    size_t count = __builtin_popcount(mask);
+
+    if (count >= n) {
+      while (--n) {
+        mask &= mask - 1;
+      }
+
+      return i + __builtin_ctz(mask) + 1;
+    }
+
+    n -= count;
+  }
+
+  return scanSkipTail(s, len, c, n, i);
+}
+#endif
+
+size_t scanSkip(const char *s, size_t len, unsigned char c, size_t n) {
+  size_t i = 0;
+
+  if (n == 0) {
+    return 0;
+  }
+
+  // Whole blocks are skipped by counting, and the block that holds the n:th
+  // byte is searched bit by bit.
+#if SCAN_AVX2
+  if (scanHasAvx2()) {
+    return scanSkipAvx2(s, len, c, n);
+  }
+#endif
+
+#if defined(__SSE2__)
+  __m128i needle = _mm_set1_epi8(c);
+
+  for (; i + 16 <= len; i += 16) {
+    __m128i block = _mm_loadu_si128((const __m128i *)&s[i]);
+    unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, needle));
+    size_t count = scanPopcount(mask);
+
+    if (count >= n) {
+      while (--n) {
+        mask &= mask - 1;
+      }
+
+      return i + __builtin_ctz(mask) + 1;
+    }
+
+    n -= count;
+  }
+#endif
+
+  return scanSkipTail(s, len, c, n, i);
+}
+
+/**
+ * Returns the other case of an ASCII letter, and anything else unchanged.
+ */
+static unsigned char scanOtherCase(unsigned char c) {
+  if (c >= 'a' && c <= 'z') {
+    return c - 'a' + 'A';
+  }
+
+  if (c >= 'A' && c <= 'Z') {
+    return c - 'A' + 'a';
+  }
+
+  return c;
+}
+
+static int scanEqual(const char *a, const char *b, int n, int icase) {
+  if (!icase) {
+    return memcmp(a, b, n) == 0;
+  }
+
+  for (int i = 0; i < n; ++i) {
+    unsigned char c = a[i];
+
+    if (c != (unsigned char)b[i] && scanOtherCase(c) != (unsigned char)b[i]) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+/**
+ * What is left of scanFind after the last full block, from i on. Without a
+ * case to fold, memchr finds the next candidate faster than a byte loop.
+ */
+static const char *scanFindTail(const char *s, size_t end, const char *needle,
+                                int nlen, int icase, size_t i) {
+  unsigned char first = needle[0];
+  unsigned char firstAlt = icase ? scanOtherCase(first) : first;
+
+  for (; i < end; ++i) {
+    if (first == firstAlt) {
+      const char *p = memchr(&s[i], first, end - i);
+
+      if (!p) {
+        return NULL;
+      }
+
+      i = p - s;
+    } else if ((unsigned char)s[i] != first &&
+               (unsigned char)s[i] != firstAlt) {
+      continue;
+    }
+
+    if (scanEqual(&s[i], needle, nlen, icase)) {
+      return &s[i];
+    }
+  }
+
+  return NULL;
+}
+
+#if SCAN_AVX2
+SCAN_TARGET_AVX2
+static const char *scanFindAvx2(const char *s, size_t end, const char *needle,
+                                int nlen, int icase) {
+  unsigned char first = needle[0];
+  unsigned char last = needle[nlen - 1];
+  __m256i f0 = _mm256_set1_epi8(first);
+  __m256i f1 = _mm256_set1_epi8(icase ? scanOtherCase(first) : first);
+  __m256i l0 = _mm256_set1_epi8(last);
+  __m256i l1 = _mm256_set1_epi8(icase ? scanOtherCase(last) : last);
+  size_t i = 0;
+
+  for (; i + 32 <= end; i += 32) {
+    __m256i head = _mm256_loadu_si256((const __m256i *)&s[i]);
+    __m256i tail = _mm256_loadu_si256((const __m256i *)&s[i + nlen - 1]);
+
+    __m256i hf = _mm256_or_si256(_mm256_cmpeq_epi8(head, f0),
+                                 _mm256_cmpeq_epi8(head, f1));
+    __m256i hl = _mm256_or_si256(_mm256_cmpeq_epi8(tail, l0),
+                                 _mm256_cmpeq_epi8(tail, l1));
+
+    unsigned int mask = _mm256_movemask_epi8(_mm256_and_si256(hf, hl));
+
+    while (mask) {
+      size_t at = i + __builtin_ctz(mask);
+
+      if (scanEqual(&s[at], needle, nlen, icase)) {
+        return &s[at];
+      }
+
+      mask &= mask - 1;
+    }
+  }
+
+  return scanFindTail(s, end, needle, nlen, icase, i);
+}
+#endif
+
+const char *scanFind(const char *s, size_t len, const char *needle, int nlen,
+                     int icase) {
+  if (nlen == 0) {
+    return s;
+  }
+
+  if ((size_t)nlen > len) {
+    return NULL;
+  }
+
+  // Candidates are the positions where both the first and the last byte of
+  // the needle line up, which rules out almost everything in a single pass
+  // over the text. Only those are compared in full.
+  size_t end = len - nlen + 1;
+  size_t i = 0;
+
+#if SCAN_AVX2
+  if (scanHasAvx2()) {
+    return scanFindAvx2(s, end, needle, nlen, icase);
+  }
+#endif
+
+#if defined(__SSE2__)
+  unsigned char first = needle[0];
+  unsigned char last = needle[nlen - 1];
+  __m128i f0 = _mm_set1_epi8(first);
+  __m128i f1 = _mm_set1_epi8(icase ? scanOtherCase(first) : first);
+  __m128i l0 = _mm_set1_epi8(last);
+  __m128i l1 = _mm_set1_epi8(icase ? scanOtherCase(last) : last);
+
+  for (; i + 16 <= end; i += 16) {
+    __m128i head = _mm_loadu_si128((const __m128i *)&s[i]);
+    __m128i tail = _mm_loadu_si128((const __m128i *)&s[i + nlen - 1]);
+
+    __m128i hf = _mm_or_si128(_mm_cmpeq_epi8(head, f0),
+                              _mm_cmpeq_epi8(head, f1));
+    __m128i hl = _mm_or_si128(_mm_cmpeq_epi8(tail, l0),
+                              _mm_cmpeq_epi8(tail, l1));
+
+    unsigned int mask = _mm_movemask_epi8(_mm_and_si128(hf, hl));
+
+    while (mask) {
+      size_t at = i + __builtin_ctz(mask);
+
+      if (scanEqual(&s[at], needle, nlen, icase)) {
+        return &s[at];
+      }
+
+      mask &= mask - 1;
+    }
+  }
+#endif
+
+  return scanFindTail(s, end, needle, nlen, icase, i);
+}
@@ -0,0 +1,63 @@
+/**
+ * @file scan.h
+ * @author Joakim Bertils
+ * @version 0.1
+ * @date 2021-04-18
+ *
+ * @brief Vectorized byte scanning.
+ *
+ * @copyright Copyright (C) 2021, Joakim Bertils
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https: //www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _SCAN_H
+#define _SCAN_H
+
+#include <stddef.h>
+
+/**
+ * The largest set of bytes that scanForAny can look for.
+ */
+#define SCAN_MAX_SET 4
+
+/**
+ * Returns the position of the first byte of s that is one of the n bytes in
+ * set, or len if there is none.
+ *
+ * On x86 the functions here use AVX2 when the CPU has it, whatever the build
+ * targets, and SSE2 otherwise. Elsewhere they are plain C.
+ */
+int scanForAny(const char *s, int len, const unsigned char *set, int n);
+
+/**
+ * Returns the number of bytes of s that are equal to c.
+ */
+size_t scanCount(const char *s, size_t len, unsigned char c);
+
+/**
+ * Returns the position just past the n:th byte of s that is equal to c, or
+ * len if there are fewer than n of them.
+ */
+size_t scanSkip(const char *s, size_t len, unsigned char c, size_t n);
+
+/**
+ * Finds the first occurrence of needle in the len bytes at s, or returns NULL
+ * if there is none. When icase is set, ASCII letters match regardless of
+ * case.
+ */
+const char *scanFind(const char *s, size_t len, const char *needle, int nlen,
+                     int icase);
+
+#endif
@@ -0,0 +1,614 @@
+/**
+ * @file search.c
+ * @author Joakim Bertils
+ * @version 0.1
+ * @date 2021-04-18
+ *
+ * @brief Incremental search.
+ *
+ * @copyright Copyright (C) 2021, Joakim Bertils
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https: //www.gnu.org/licenses/>.
+ *
+ */
+
+#include "search.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "line_store.h"
+#include "mapped_file.h"
+#include "row.h"
+#include "scan.h"
+#include "trigram.h"
+
+extern void die(const char *s);
+
+/**
+ * Candidates further apart than this are reached by looking up the row
+ * instead of stepping the iterator.
+ */
+#define SR_ITER_SKIP 16
+
+/**
+ * Untouched lines in a mapping are searched this many at a time, straight
+ * from the mapping.
+ */
+#define SR_RUN_LINES 65536
+
+/**
+ * Candidates are only filtered when at most one row in this many is one.
+ * Looking up a row in a mapping costs about as much as searching a few
+ * hundred rows in one go.
+ */
+#define SR_FILTER_RATIO 64
+
+/**
+ * Buffers with at least this many rows are searched on up to
+ * SR_MAX_THREADS threads.
+ */
+#define SR_PARALLEL_ROWS 65536
+#define SR_MAX_THREADS 16
+
+/**
+ * When several buffers are searched, large ones are split into pieces of
+ * this many rows, so that one large buffer does not keep a single thread
+ * busy after the others are done.
+ */
+#define SR_TASK_ROWS (1 << 20)
+
+/**
+ * A range of rows of a buffer that is searched as one piece, and the
+ * matches found in it.
+ */
+struct srTask {
+  struct searchState part;
+  buffer_t *buffer;
+  int from;
+  int to;
+};
+
+/**
+ * Tasks handed out to the threads, each of which takes the first one that
+ * nobody has started on yet.
+ */
+struct srPool {
+  struct srTask *tasks;
+  int ntasks;
+  atomic_int next;
+};
+
+const char *srFindIn(struct searchState *sr, const char *s, int len, int from,
+                     int *mlen) {
+  if (sr->regex) {
+    return sr->compiled ? reFind(&sr->re, s, len, from, mlen) : NULL;
+  }
+
+  *mlen = sr->qlen;
+
+  return scanFind(s + from, len - from, sr->query, sr->qlen, sr->icase);
+}
+
+static int srMatches(struct searchState *sr, const char *s, int len) {
+  if (sr->regex) {
+    return sr->compiled && reSearch(&sr->re, s, len);
+  }
+
+  return scanFind(s, len, sr->query, sr->qlen, sr->icase) != NULL;
+}
+
+static void srReserve(struct searchState *sr, int n) {
+  if (n <= sr->cap) {
+    return;
+  }
+
+  while (sr->cap < n) {
+    sr->cap = sr->cap ? sr->cap * 2 : 256;
+  }
+
+  sr->rows = realloc(sr->rows, sizeof(int) * sr->cap);
+
+  if (sr->rows == NULL) {
+    die("realloc");
+  }
+}
+
+static void srAddRow(struct searchState *sr, int at) {
+  srReserve(sr, sr->nrows + 1);
+
+  sr->rows[sr->nrows++] = at;
+}
+
+/**
+ * Searches count lines of raw text, starting at row at. The text is searched
+ * as a whole, and the rows of the matches are found by counting the line
+ * breaks in between. The query never contains a line break, so no match can
+ * span two rows.
+ */
+static void srScanRun(struct searchState *sr, int at, int count,
+                      const char *s, size_t len) {
+  const char *end = s + len;
+  const char *match;
+  int last = at + count;
+
+  // A pattern can match across a line break, so it is matched one line at a
+  // time instead.
+  if (sr->regex) {
+    for (; at < last; ++at) {
+      const char *nl = memchr(s, '\n', end - s);
+      const char *eol = nl ? nl : end;
+
+      while (eol > s && eol[-1] == '\r') {
+        --eol;
+      }
+
+      if (srMatches(sr, s, eol - s)) {
+        srAddRow(sr, at);
+      }
+
+      s = nl ? nl + 1 : end;
+    }
+
+    return;
+  }
+
+  while (at < last &&
+         (match = scanFind(s, end - s, sr->query, sr->qlen, sr->icase))) {
+    at += scanCount(s, match - s, '\n');
+
+    srAddRow(sr, at);
+
+    // Continue at the start of the next row.
+    s = memchr(match, '\n', end - match);
+
+    if (!s) {
+      break;
+    }
+
+    ++s;
+    ++at;
+  }
+}
+
+/**
+ * Searches the rows in [from, to). With shared set, the rows are read in a
+ * way that lets other threads search other rows at the same time.
+ */
+static void srScanRange(struct searchState *sr, struct lineStore *rows,
+                        int from, int to, int shared) {
+  struct lineIter it;
+  const char *s;
+  int len;
+  int at = from;
+
+  if (shared) {
+    lsIterInitShared(rows, from, &it);
+  } else {
+    lsIterInit(rows, from, &it);
+  }
+
+  while (at < to) {
+    size_t runlen;
+    int max = (to - at < SR_RUN_LINES) ? to - at : SR_RUN_LINES;
+    int line = lsIterLine(&it);
+
+    // Untouched lines in blocks that the index rules out are stepped over
+    // without being read.
+    if (sr->indexed && line >= 0) {
+      int block = line / TI_BLOCK_LINES;
+      int left = (block + 1) * TI_BLOCK_LINES - line;
+
+      if (max > left) {
+        max = left;
+      }
+
+      if (!((sr->blocks[block >> 6] >> (block & 63)) & 1)) {
+        at += lsIterSkipRun(&it, max);
+        continue;
+      }
+    }
+
+    int count = lsIterNextRun(&it, max, &s, &runlen);
+
+    if (count > 0) {
+      srScanRun(sr, at, count, s, runlen);
+
+      // Shared readers do not keep track of what they have read, so the
+      // pages are handed back as soon as they are done with.
+      if (shared) {
+        mfRelease(rows->map, s, runlen);
+      }
+
+      at += count;
+      continue;
+    }
+
+    if ((s = lsIterNextChars(&it, &len)) == NULL) {
+      break;
+    }
+
+    if (srMatches(sr, s, len)) {
+      srAddRow(sr, at);
+    }
+
+    ++at;
+  }
+}
+
+int srIgnoreCase(const char *query, int regex) {
+  for (; *query; ++query) {
+    if (regex && query[0] == '\\' && query[1]) {
+      ++query;
+    } else if (*query >= 'A' && *query <= 'Z') {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+/**
+ * Returns the number of threads to search on.
+ */
+static int srThreads() {
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+
+  if (cores < 1) {
+    return 1;
+  }
+
+  return cores > SR_MAX_THREADS ? SR_MAX_THREADS : cores;
+}
+
+/**
+ * Sets the query of sr, and compiles it if sr searches for patterns.
+ */
+static void srSetQuery(struct searchState *sr, const char *query) {
+  free(sr->query);
+
+  sr->query = strdup(query);
+  sr->qlen = strlen(query);
+  sr->icase = srIgnoreCase(query, sr->regex);
+
+  if (sr->query == NULL) {
+    die("strdup");
+  }
+
+  if (sr->compiled) {
+    reFree(&sr->re);
+    sr->compiled = 0;
+  }
+
+  if (sr->regex) {
+    sr->compiled = reCompile(&sr->re, query, sr->icase) == 0;
+  }
+}
+
+/**
+ * Looks up the blocks that may contain the query in the trigram index of the
+ * buffer, if it has one that is ready. A pattern is looked up by the string
+ * that every match of it contains.
+ */
+static void srUseIndex(struct searchState *sr, buffer_t *buffer) {
+  struct trigramIndex *ti = buffer->index;
+  const char *s = sr->query;
+  int len = sr->qlen;
+
+  sr->indexed = 0;
+
+  if (ti == NULL || (sr->regex && !sr->compiled)) {
+    return;
+  }
+
+  if (sr->regex) {
+    s = sr->re.must;
+    len = sr->re.mustLen;
+  }
+
+  if (sr->blockWords < ti->words) {
+    sr->blocks = realloc(sr->blocks, sizeof(uint64_t) * ti->words);
+    sr->blockWords = ti->words;
+
+    if (sr->blocks == NULL) {
+      die("realloc");
+    }
+  }
+
+  sr->indexed = tiCandidates(ti, s, len, sr->blocks);
+}
+
+static void srTaskInit(struct srTask *task, struct searchState *sr,
+                       buffer_t *buffer, int from, int to) {
+  struct searchState *part = &task->part;
+
+  memset(part, 0, sizeof(*part));
+
+  part->query = sr->query;
+  part->qlen = sr->qlen;
+  part->icase = sr->icase;
+  part->regex = sr->regex;
+  part->blocks = sr->blocks;
+  part->indexed = sr->indexed;
+
+  // The automaton fills in its states as it runs, so every task needs one of
+  // its own.
+  if (sr->compiled) {
+    part->compiled = reCompile(&part->re, sr->query, sr->icase) == 0;
+  }
+
+  task->buffer = buffer;
+  task->from = from;
+  task->to = to;
+}
+
+/**
+ * Appends the matches of the task to sr, and frees the task. The tasks of a
+ * buffer must be collected in the order of their rows.
+ */
+static void srTaskCollect(struct srTask *task, struct searchState *sr) {
+  struct searchState *part = &task->part;
+
+  srReserve(sr, sr->nrows + part->nrows);
+
+  memcpy(&sr->rows[sr->nrows], part->rows, sizeof(int) * part->nrows);
+  sr->nrows += part->nrows;
+
+  free(part->rows);
+
+  if (part->compiled) {
+    reFree(&part->re);
+  }
+}
+
+static void *srWorker(void *arg) {
+  struct srPool *pool = arg;
+  int i;
+
+  while ((i = atomic_fetch_add(&pool->next, 1)) < pool->ntasks) {
+    struct srTask *task = &pool->tasks[i];
+
+    srScanRange(&task->part, &task->buffer->rows, task->from, task->to, 1);
+  }
+
+  return NULL;
+}
+
+/**
+ * Runs the tasks on up to nthreads threads. The calling thread is one of
+ * them, and takes whatever is left if fewer threads could be started.
+ */
+static void srRunTasks(struct srTask *tasks, int ntasks, int nthreads) {
+  pthread_t threads[SR_MAX_THREADS];
+  struct srPool pool;
+
+  pool.tasks = tasks;
+  pool.ntasks = ntasks;
+  atomic_init(&pool.next, 0);
+
+  if (nthreads > ntasks) {
+    nthreads = ntasks;
+  }
+
+  for (int i = 1; i < nthreads; ++i) {
+    if (pthread_create(&threads[i], NULL, srWorker, &pool) != 0) {
+      nthreads = i;
+      break;
+    }
+  }
+
+  srWorker(&pool);
+
+  for (int i = 1; i < nthreads; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+}
+
+/**
+ * Splits the buffer into one range of rows per core and searches the ranges
+ * at the same time. The matches in each range are sorted, so putting them
+ * one after the other keeps them sorted. Returns 0 if there is only one
+ * core to run on.
+ */
+static int srScanParallel(struct searchState *sr, buffer_t *buffer) {
+  struct srTask tasks[SR_MAX_THREADS];
+  int n = srThreads();
+
+  if (n < 2) {
+    return 0;
+  }
+
+  for (int i = 0; i < n; ++i) {
+    srTaskInit(&tasks[i], sr, buffer, (long long)buffer->numrows * i / n,
+               (long long)buffer->numrows * (i + 1) / n);
+  }
+
+  srRunTasks(tasks, n, n);
+
+  for (int i = 0; i < n; ++i) {
+    srTaskCollect(&tasks[i], sr);
+  }
+
+  return 1;
+}
+
+/**
+ * Searches every row of the buffer.
+ */
+static void srScanAll(struct searchState *sr, buffer_t *buffer) {
+  sr->nrows = 0;
+
+  if (buffer->numrows >= SR_PARALLEL_ROWS && srScanParallel(sr, buffer)) {
+    return;
+  }
+
+  srScanRange(sr, &buffer->rows, 0, buffer->numrows, 0);
+}
+
+/**
+ * Keeps the candidates that still match after the query grew.
+ */
+static void srFilter(struct searchState *sr, buffer_t *buffer) {
+  struct lineIter it;
+  int pos = -1;
+  int kept = 0;
+
+  for (int i = 0; i < sr->nrows; ++i) {
+    int at = sr->rows[i];
+    const char *s;
+    int len;
+
+    // Nearby candidates are reached by stepping the iterator, the others by
+    // starting it over at the row.
+    if (pos < 0 || at - pos > SR_ITER_SKIP) {
+      lsIterInit(&buffer->rows, at, &it);
+      pos = at;
+    }
+
+    do {
+      s = lsIterNextChars(&it, &len);
+    } while (pos++ < at);
+
+    if (srMatches(sr, s, len)) {
+      sr->rows[kept++] = at;
+    }
+  }
+
+  sr->nrows = kept;
+}
+
+void srReset(struct searchState *sr) {
+  free(sr->query);
+
+  if (sr->compiled) {
+    reFree(&sr->re);
+  }
+
+  sr->query = NULL;
+  sr->qlen = 0;
+  sr->compiled = 0;
+  sr->nrows = 0;
+  sr->current = -1;
+  sr->indexed = 0;
+}
+
+void srFree(struct searchState *sr) {
+  srReset(sr);
+
+  free(sr->rows);
+  free(sr->blocks);
+
+  sr->rows = NULL;
+  sr->cap = 0;
+  sr->blocks = NULL;
+  sr->blockWords = 0;
+}
+
+void srUpdate(struct searchState *sr, buffer_t *buffer, const char *query) {
+  int qlen = strlen(query);
+
+  if (sr->query && qlen == sr->qlen && !memcmp(query, sr->query, qlen)) {
+    return;
+  }
+
+  // An empty query would match every row, so it is not searched for at all.
+  if (qlen == 0) {
+    srReset(sr);
+    return;
+  }
+
+  // Every row that contains the longer query also contains the shorter one.
+  // That holds across the switch to matching case as well, since that only
+  // makes the longer query stricter.
+  int grew = !sr->regex && sr->query && qlen > sr->qlen &&
+             !memcmp(query, sr->query, sr->qlen);
+
+  srSetQuery(sr, query);
+  srUseIndex(sr, buffer);
+
+  // Visiting the candidates one by one only pays off while they are few.
+  // Otherwise it is faster to search the whole buffer again.
+  sr->current = -1;
+
+  if (grew && sr->nrows <= buffer->numrows / SR_FILTER_RATIO) {
+    srFilter(sr, buffer);
+  } else {
+    srScanAll(sr, buffer);
+  }
+}
+
+int srNext(struct searchState *sr, int direction) {
+  if (sr->nrows == 0) {
+    sr->current = -1;
+    return -1;
+  }
+
+  if (sr->current < 0) {
+    sr->current = 0;
+  } else {
+    sr->current = (sr->current + direction + sr->nrows) % sr->nrows;
+  }
+
+  return sr->rows[sr->current];
+}
+
+void srSearchBuffers(buffer_t **buffers, int n, const char *query,
+                     struct searchState *found) {
+  int ntasks = 0;
+
+  for (int i = 0; i < n; ++i) {
+    ntasks += (buffers[i]->numrows + SR_TASK_ROWS - 1) / SR_TASK_ROWS;
+  }
+
+  struct srTask *tasks = malloc(sizeof(struct srTask) * (ntasks ? ntasks : 1));
+
+  if (tasks == NULL) {
+    die("malloc");
+  }
+
+  int k = 0;
+
+  for (int i = 0; i < n; ++i) {
+    srSetQuery(&found[i], query);
+    srUseIndex(&found[i], buffers[i]);
+
+    found[i].nrows = 0;
+    found[i].current = -1;
+
+    for (int from = 0; from < buffers[i]->numrows; from += SR_TASK_ROWS) {
+      int to = from + SR_TASK_ROWS;
+
+      if (to > buffers[i]->numrows) {
+        to = buffers[i]->numrows;
+      }
+
+      srTaskInit(&tasks[k++], &found[i], buffers[i], from, to);
+    }
+  }
+
+  srRunTasks(tasks, ntasks, srThreads());
+
+  // The tasks were laid out buffer by buffer, in the order of their rows.
+  k = 0;
+
+  for (int i = 0; i < n; ++i) {
+    for (int from = 0; from < buffers[i]->numrows; from += SR_TASK_ROWS) {
+      srTaskCollect(&tasks[k++], &found[i]);
+    }
+  }
+
+  free(tasks);
+}
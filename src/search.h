@@ -0,0 +1,106 @@
+/**
+ * @file search.h
+ * @author Joakim Bertils
+ * @version 0.1
+ * @date 2021-04-18
+ *
+ * @brief Search interface.
+ *
+ * @copyright Copyright (C) 2021, Joakim Bertils
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https: //www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _SEARCH_H
+#define _SEARCH_H
+
+#include <stdint.h>
+
+#include "editor.h"
+#include "regexp.h"
+
+/**
+ * The rows that contain the current query, in ascending order, and the
+ * index of the one the cursor is on. When a character is appended to the
+ * query, only these rows have to be searched again. Any other change to the
+ * query searches the whole buffer, on several threads if it is large.
+ *
+ * A query in lower case ignores case, while one with an upper case letter in
+ * it matches case exactly.
+ *
+ * In a buffer with a trigram index, indexed is set and blocks marks the
+ * blocks of the mapping that may contain the query. Untouched lines in the
+ * other blocks are not searched at all.
+ *
+ * When regex is set, the query is a regular expression. Then every change
+ * to the query searches the whole buffer, since a longer pattern does not
+ * necessarily match less, and a query that does not compile matches
+ * nothing.
+ */
+struct searchState {
+  char *query;
+  int qlen;
+  int icase;
+  int regex;
+  int compiled;
+  struct regexp re;
+  int *rows;
+  int nrows;
+  int cap;
+  int current;
+  uint64_t *blocks;
+  int blockWords;
+  int indexed;
+};
+
+/**
+ * A query without upper case letters matches regardless of case. In a
+ * pattern, the letter after a backslash does not count.
+ */
+int srIgnoreCase(const char *query, int regex);
+
+void srReset(struct searchState *sr);
+void srFree(struct searchState *sr);
+
+/**
+ * Sets the query of sr and finds the rows of the buffer that match it. An
+ * empty query matches no rows.
+ */
+void srUpdate(struct searchState *sr, buffer_t *buffer, const char *query);
+
+/**
+ * Steps current to the next row with a match in the given direction,
+ * wrapping around the buffer, or to the first one if there is no current
+ * row. Returns the row, or -1 if no row matches.
+ */
+int srNext(struct searchState *sr, int direction);
+
+/**
+ * Finds the first match of the current query in the row of len bytes at s,
+ * which need not be NUL terminated, that starts at or after from. Stores the
+ * length of the match in mlen.
+ */
+const char *srFindIn(struct searchState *sr, const char *s, int len, int from,
+                     int *mlen);
+
+/**
+ * Searches all n buffers for query at once, spread over the cores, and
+ * stores the rows with matches in buffers[i] in found[i]. found must be
+ * zeroed, or left from an earlier call, and be freed with srFree. Whether
+ * query is a pattern is taken from the regex flag of each found[i].
+ */
+void srSearchBuffers(buffer_t **buffers, int n, const char *query,
+                     struct searchState *found);
+
+#endif
@@ -25,8 +25,10 @@
 #include "syntax.h"
 
 #include <ctype.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 char *C_HL_extensions[] = {".c", ".h", ".cpp", ".hpp", NULL};
 char *C_HL_keywords[] = {"switch",    "if",      "while",   "for",    "break",
@@ -44,158 +46,749 @@ char *Python_HL_keywords[] = {
     "or",     "pass",   "print",  "raise", "return",   "try",    "while",
     "with",   "yield",  NULL};
 
+// The keyword table and the lexer are left zeroed, and compiled the first
+// time a file of the type is opened.
 static struct editorSyntax HLDB[] = {
-    {"c", C_HL_extensions, C_HL_keywords, "//", "/*", "*/",
-     HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS},
-    {"Py", Python_HL_extensions, Python_HL_keywords, "#", NULL, NULL,
-     HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS},
+    {
+        .filetype = "c",
+        .filematch = C_HL_extensions,
+        .keywords = C_HL_keywords,
+        .singleline_comment_start = "//",
+        .multiline_comment_start = "/*",
+        .multiline_comment_end = "*/",
+        .flags = HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+    },
+    {
+        .filetype = "Py",
+        .filematch = Python_HL_extensions,
+        .keywords = Python_HL_keywords,
+        .singleline_comment_start = "#",
+        .multiline_comment_start = NULL,
+        .multiline_comment_end = NULL,
+        .flags = HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+    },
 };
 
 #define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
 
+extern void die(const char *s);
+
 int is_separator(int c) {
   return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];:", c) != NULL;
 }
 
-void editorUpdateSyntax(editorConfig_t *conf, erow *row) {
-  row->hl = realloc(row->hl, row->rsize);
-  memset(row->hl, HL_NORMAL, row->rsize);
+static unsigned int kwHash(const char *s, int len, unsigned int seed) {
+  unsigned int h = 2166136261u ^ seed;
+
+  for (int i = 0; i < len; ++i) {
+    h ^= (unsigned char)s[i];
+    h *= 16777619u;
+  }
+
+  return h;
+}
+
+/**
+ * Tries to place every keyword in a slot of its own with the given seed.
+ * Keywords ending in '|' are of the second class. A keyword that is listed
+ * twice keeps its first class.
+ */
+static int kwPlace(struct keywordTable *t, char **keywords) {
+  memset(t->slots, 0, sizeof(struct keywordSlot) * (t->mask + 1));
+  t->max_len = 0;
+
+  for (int j = 0; keywords && keywords[j]; ++j) {
+    int len = strlen(keywords[j]);
+    int kw2 = len > 0 && keywords[j][len - 1] == '|';
+
+    if (kw2) {
+      len--;
+    }
+
+    struct keywordSlot *slot =
+        &t->slots[kwHash(keywords[j], len, t->seed) & t->mask];
+
+    if (slot->word) {
+      if (slot->len == len && !memcmp(slot->word, keywords[j], len)) {
+        continue;
+      }
+
+      return 0;
+    }
+
+    slot->word = keywords[j];
+    slot->len = len;
+    slot->hl = kw2 ? HL_KEYWORD2 : HL_KEYWORD1;
+
+    if (len > t->max_len) {
+      t->max_len = len;
+    }
+  }
+
+  return 1;
+}
+
+/**
+ * Compiles the keyword list of a syntax. The table starts at twice the
+ * number of keywords and is doubled whenever no seed gives a perfect hash.
+ */
+static void kwCompile(struct editorSyntax *syntax) {
+  struct keywordTable *t = &syntax->kwtable;
+  unsigned int size = 4;
+  int n = 0;
+
+  while (syntax->keywords && syntax->keywords[n]) {
+    ++n;
+  }
+
+  while (size < 2 * (unsigned int)n) {
+    size *= 2;
+  }
+
+  while (1) {
+    t->slots = malloc(sizeof(struct keywordSlot) * size);
+
+    if (t->slots == NULL) {
+      die("malloc");
+    }
+
+    t->mask = size - 1;
+
+    for (t->seed = 0; t->seed < 4096; ++t->seed) {
+      if (kwPlace(t, syntax->keywords)) {
+        return;
+      }
+    }
+
+    free(t->slots);
+    size *= 2;
+  }
+}
+
+/**
+ * Returns the class of the keyword s, or HL_NORMAL if it is not one.
+ */
+static int kwLookup(struct keywordTable *t, const char *s, int len) {
+  if (len == 0 || len > t->max_len) {
+    return HL_NORMAL;
+  }
+
+  struct keywordSlot *slot = &t->slots[kwHash(s, len, t->seed) & t->mask];
+
+  if (slot->word && slot->len == len && !memcmp(slot->word, s, len)) {
+    return slot->hl;
+  }
+
+  return HL_NORMAL;
+}
+
+static void lxSet(struct syntaxLexer *lx, int state, int cls, int action,
+                  int hl, int next) {
+  lx->table[state][cls].action = action;
+  lx->table[state][cls].hl = hl;
+  lx->table[state][cls].next = next;
+}
+
+/**
+ * Compiles the comment delimiters, quotes and flags of a syntax into the
+ * lexer table. The states before a byte are:
+ *
+ * LX_SEP     after a separator, where numbers and keywords may start
+ * LX_WORD    inside a word
+ * LX_NUMBER  after a digit of a number
+ * LX_COMMENT inside a multi-line comment
+ * LX_STRING  inside a string, one state and one after a backslash per quote
+ */
+static void lxCompile(struct editorSyntax *syntax) {
+  struct syntaxLexer *lx = &syntax->lexer;
+  const char *quotes = syntax->flags & HL_HIGHLIGHT_STRINGS ? "\"'" : "";
+  int numbers = syntax->flags & HL_HIGHLIGHT_NUMBERS;
+  char *scs = syntax->singleline_comment_start;
+  char *mcs = syntax->multiline_comment_start;
+  char *mce = syntax->multiline_comment_end;
+  int nquotes = strlen(quotes);
+
+  lx->scs_len = scs ? strlen(scs) : 0;
+  lx->mcs_len = mcs ? strlen(mcs) : 0;
+  lx->mce_len = mce ? strlen(mce) : 0;
+
+  // Multi-line comments need both delimiters.
+  if (!lx->mcs_len || !lx->mce_len) {
+    lx->mcs_len = 0;
+    lx->mce_len = 0;
+  }
+
+  for (int c = 0; c < 256; ++c) {
+    int cls = LX_C_OTHER;
+
+    if (c != '\0' && strchr(quotes, c)) {
+      cls = LX_C_QUOTE + (strchr(quotes, c) - quotes);
+    } else if (is_separator(c)) {
+      cls = c == '.' ? LX_C_DOT : LX_C_SEP;
+    } else if (isdigit(c)) {
+      cls = LX_C_DIGIT;
+    } else if (c == '\\') {
+      cls = LX_C_ESCAPE;
+    }
+
+    lx->cls[c] = cls;
+    lx->base[c] = cls;
+  }
+
+  if (lx->scs_len) {
+    lx->cls[(unsigned char)scs[0]] = LX_C_DELIM;
+  }
 
-  if (conf->activeBuffer->syntax == NULL) {
+  if (lx->mcs_len) {
+    lx->cls[(unsigned char)mcs[0]] = LX_C_DELIM;
+    lx->cls[(unsigned char)mce[0]] = LX_C_DELIM;
+  }
+
+  for (int state = LX_SEP; state <= LX_NUMBER; ++state) {
+    int word = state == LX_SEP ? LX_KEYWORD : LX_EMIT;
+
+    lxSet(lx, state, LX_C_OTHER, word, HL_NORMAL, LX_WORD);
+    lxSet(lx, state, LX_C_ESCAPE, word, HL_NORMAL, LX_WORD);
+    lxSet(lx, state, LX_C_SEP, LX_EMIT, HL_NORMAL, LX_SEP);
+    lxSet(lx, state, LX_C_DOT, LX_EMIT, HL_NORMAL, LX_SEP);
+    lxSet(lx, state, LX_C_DIGIT, word, HL_NORMAL, LX_WORD);
+    lxSet(lx, state, LX_C_DELIM, LX_DELIM, HL_NORMAL, state);
+
+    // A number starts after a separator and goes on with digits and dots.
+    if (numbers && state != LX_WORD) {
+      lxSet(lx, state, LX_C_DIGIT, LX_EMIT, HL_NUMBER, LX_NUMBER);
+    }
+
+    if (numbers && state == LX_NUMBER) {
+      lxSet(lx, state, LX_C_DOT, LX_EMIT, HL_NUMBER, LX_NUMBER);
+    }
+
+    for (int q = 0; q < nquotes; ++q) {
+      lxSet(lx, state, LX_C_QUOTE + q, LX_EMIT, HL_STRING, LX_STRING + 2 * q);
+    }
+  }
+
+  for (int cls = 0; cls < LX_CLASSES; ++cls) {
+    lxSet(lx, LX_COMMENT, cls, LX_EMIT, HL_MLCOMMENT, LX_COMMENT);
+  }
+
+  lxSet(lx, LX_COMMENT, LX_C_DELIM, LX_DELIM, HL_MLCOMMENT, LX_COMMENT);
+
+  // Inside a string, the byte after a backslash is taken as is, and the
+  // opening quote ends it.
+  for (int q = 0; q < nquotes; ++q) {
+    int string = LX_STRING + 2 * q;
+
+    for (int cls = 0; cls < LX_CLASSES; ++cls) {
+      lxSet(lx, string, cls, LX_EMIT, HL_STRING, string);
+      lxSet(lx, string + 1, cls, LX_EMIT, HL_STRING, string);
+    }
+
+    lxSet(lx, string, LX_C_ESCAPE, LX_EMIT, HL_STRING, string + 1);
+    lxSet(lx, string, LX_C_QUOTE + q, LX_EMIT, HL_STRING, LX_SEP);
+    lxSet(lx, string, LX_C_DELIM, LX_BASE, HL_STRING, string);
+  }
+
+  // Collect the bytes that end a run in each state.
+  for (int state = 0; state < LX_STATES; ++state) {
+    int n = 0;
+    int hl = -1;
+
+    for (int c = 0; c < 256 && n >= 0; ++c) {
+      struct lexStep *step = &lx->table[state][lx->cls[c]];
+
+      if (step->action == LX_EMIT && step->next == state &&
+          (hl < 0 || step->hl == hl)) {
+        hl = step->hl;
+      } else if (n < SCAN_MAX_SET) {
+        lx->stops[state][n++] = c;
+      } else {
+        n = -1;
+      }
+    }
+
+    lx->nstops[state] = n;
+    lx->run_hl[state] = hl < 0 ? HL_NORMAL : hl;
+  }
+}
+
+/**
+ * Collects the highlight spans of a row. Spans are emitted left to right, and
+ * a span that continues the previous one with the same class is merged into
+ * it.
+ */
+struct hlBuilder {
+  struct arena *ar;
+  struct hlSpan *spans;
+  int count;
+  int cap;
+};
+
+static void hlEmit(struct hlBuilder *b, int start, int len, int hl) {
+  if (len <= 0) {
     return;
   }
 
-  char **keywords = conf->activeBuffer->syntax->keywords;
+  if (b->count > 0) {
+    struct hlSpan *last = &b->spans[b->count - 1];
+
+    if (last->hl == hl && last->start + last->len == start) {
+      last->len += len;
+      return;
+    }
+  }
+
+  if (b->count == b->cap) {
+    b->cap = b->cap ? b->cap * 2 : 4;
+    b->spans = arRealloc(b->ar, b->spans, sizeof(struct hlSpan) * b->cap);
+  }
+
+  b->spans[b->count].start = start;
+  b->spans[b->count].len = len;
+  b->spans[b->count].hl = hl;
+  b->count++;
+}
+
+/**
+ * Replaces the spans of a row with the ones collected by the builder.
+ */
+static void hlFinish(struct hlBuilder *b, erow *row) {
+  arFree(b->ar, row->hl);
 
-  char *scs = conf->activeBuffer->syntax->singleline_comment_start;
+  row->hl = b->spans;
+  row->hl_spans = b->count;
+}
 
-  char *mcs = conf->activeBuffer->syntax->multiline_comment_start;
-  char *mce = conf->activeBuffer->syntax->multiline_comment_end;
+static int lxIsSeparator(struct syntaxLexer *lx, unsigned char c) {
+  return lx->base[c] == LX_C_SEP || lx->base[c] == LX_C_DOT;
+}
 
-  int scs_len = scs ? strlen(scs) : 0;
-  int mcs_len = mcs ? strlen(mcs) : 0;
-  int mce_len = mce ? strlen(mce) : 0;
+static int lxMatch(erow *row, int at, const char *s, int len) {
+  return len && at + len <= row->rsize && !memcmp(&row->render[at], s, len);
+}
 
-  int prev_sep = 1;
-  int in_string = 0;
-  int in_comment =
-      (row->idx > 0 && conf->activeBuffer->row[row->idx - 1].hl_open_comment);
+/**
+ * Highlights a single row, given whether the previous row left a multi-line
+ * comment open.
+ */
+static void editorHighlightRow(struct editorSyntax *syntax, struct arena *ar,
+                               erow *row, int in_comment) {
+  struct hlBuilder b = {ar, NULL, 0, 0};
 
+  if (syntax == NULL) {
+    hlFinish(&b, row);
+    return;
+  }
+
+  struct syntaxLexer *lx = &syntax->lexer;
+  int state = in_comment ? LX_COMMENT : LX_SEP;
   int i = 0;
 
   while (i < row->rsize) {
-    char c = row->render[i];
-    unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
+    if (lx->nstops[state] >= 0) {
+      int run = scanForAny(&row->render[i], row->rsize - i, lx->stops[state],
+                           lx->nstops[state]);
+
+      if (lx->run_hl[state] != HL_NORMAL) {
+        hlEmit(&b, i, run, lx->run_hl[state]);
+      }
+
+      i += run;
 
-    if (scs_len && !in_string && !in_comment) {
-      if (!strncmp(&row->render[i], scs, scs_len)) {
-        memset(&row->hl[i], HL_COMMENT, row->rsize - i);
+      if (i == row->rsize) {
         break;
       }
     }
 
-    if (mcs_len && mce_len && !in_string) {
-      if (in_comment) {
-        row->hl[i] = HL_MLCOMMENT;
+    unsigned char c = row->render[i];
+    const struct lexStep *step = &lx->table[state][lx->cls[c]];
 
-        if (!strncmp(&row->render[i], mce, mce_len)) {
-          memset(&row->hl[i], HL_MLCOMMENT, mce_len);
-          i += mce_len;
-          in_comment = 0;
-          prev_sep = 1;
+    if (step->action == LX_DELIM) {
+      if (state == LX_COMMENT) {
+        if (lxMatch(row, i, syntax->multiline_comment_end, lx->mce_len)) {
+          hlEmit(&b, i, lx->mce_len, HL_MLCOMMENT);
+          i += lx->mce_len;
+          state = LX_SEP;
           continue;
-        } else {
-          ++i;
+        }
+      } else {
+        if (lxMatch(row, i, syntax->singleline_comment_start, lx->scs_len)) {
+          hlEmit(&b, i, row->rsize - i, HL_COMMENT);
+          break;
+        }
+
+        if (lxMatch(row, i, syntax->multiline_comment_start, lx->mcs_len)) {
+          hlEmit(&b, i, lx->mcs_len, HL_MLCOMMENT);
+          i += lx->mcs_len;
+          state = LX_COMMENT;
           continue;
         }
-      } else if (!strncmp(&row->render[i], mcs, mcs_len)) {
-        memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
-        i += mcs_len;
-        in_comment = 1;
+      }
+    }
+
+    if (step->action == LX_DELIM || step->action == LX_BASE) {
+      step = &lx->table[state][lx->base[c]];
+    }
+
+    if (step->action == LX_KEYWORD) {
+      // Keywords contain no separators, so the word starting here is the
+      // only candidate. There is no need to look further than the longest
+      // keyword.
+      int len = 0;
+
+      while (len <= syntax->kwtable.max_len && i + len < row->rsize &&
+             !lxIsSeparator(lx, row->render[i + len])) {
+        ++len;
+      }
+
+      int kw = kwLookup(&syntax->kwtable, &row->render[i], len);
+
+      if (kw != HL_NORMAL) {
+        hlEmit(&b, i, len, kw);
+        i += len;
+        state = LX_WORD;
         continue;
       }
     }
 
-    if (conf->activeBuffer->syntax->flags & HL_HIGHLIGHT_STRINGS) {
-      if (in_string) {
-        row->hl[i] = HL_STRING;
+    // Plain text is whatever the spans leave uncovered.
+    if (step->hl != HL_NORMAL) {
+      hlEmit(&b, i, 1, step->hl);
+    }
+
+    state = step->next;
+    ++i;
+  }
 
-        if (c == '\\' && i + 1 < row->rsize) {
-          row->hl[i + 1] = HL_STRING;
+  hlFinish(&b, row);
 
-          i += 2;
+  row->hl_open_comment = (state == LX_COMMENT);
+}
 
-          continue;
-        }
+/**
+ * Only syntaxes with multi-line comments carry state from one row to the
+ * next. For everything else each row can be highlighted on its own.
+ */
+static int editorSyntaxHasState(struct editorSyntax *syntax) {
+  return syntax && syntax->multiline_comment_start &&
+         syntax->multiline_comment_start[0] && syntax->multiline_comment_end &&
+         syntax->multiline_comment_end[0];
+}
 
-        if (c == in_string) {
-          in_string = 0;
-        }
+/**
+ * Brings a row up to date, given the state the row above it ended in. A row
+ * that was not edited and is entered in the same state as last time keeps its
+ * highlight.
+ *
+ * Returns non-zero if the row had to be highlighted again.
+ */
+static int editorSyntaxRefreshRow(editorConfig_t *conf, erow *row,
+                                  int in_comment) {
+  if (!row->stale && row->hl_entry == in_comment) {
+    return 0;
+  }
 
-        ++i;
+  if (row->stale) {
+    editorUpdateRender(&conf->activeBuffer->arena, row);
+  }
 
-        prev_sep = 1;
+  editorHighlightRow(conf->activeBuffer->syntax, &conf->activeBuffer->arena,
+                     row, in_comment);
 
-        continue;
-      } else {
-        if (c == '"' || c == '\'') {
-          in_string = c;
-          row->hl[i] = HL_STRING;
-          ++i;
-          continue;
-        }
+  row->hl_entry = in_comment;
+  row->stale = 0;
+
+  return 1;
+}
+
+/**
+ * Walks the frontier forward until it has passed the given row.
+ *
+ * Every row from hl_valid on is up to date for the state it is entered in,
+ * and every row after hl_valid was highlighted from the state the row above
+ * it ends in. So once the walk reaches a row at or after hl_valid that it
+ * does not have to highlight again, the rest of the buffer is up to date, and
+ * the walk stops there.
+ *
+ * Returns non-zero if any row on screen got a new highlight.
+ */
+static int editorSyntaxAdvance(editorConfig_t *conf, int to) {
+  buffer_t *buffer = conf->activeBuffer;
+  struct lineIter it;
+  int at = buffer->hl_frontier;
+  int in_comment = 0;
+  int redraw = 0;
+
+  if (to >= buffer->numrows) {
+    to = buffer->numrows - 1;
+  }
+
+  if (at > to) {
+    return 0;
+  }
+
+  if (at > 0) {
+    in_comment = editorGetRow(buffer, at - 1)->hl_open_comment;
+  }
+
+  lsIterInit(&buffer->rows, at, &it);
+
+  for (; at <= to; ++at) {
+    erow *row = lsIterNext(&it);
+
+    if (editorSyntaxRefreshRow(conf, row, in_comment)) {
+      if (at >= buffer->rowoff && at < buffer->rowoff + conf->screenRows) {
+        redraw = 1;
       }
+    } else if (at >= buffer->hl_valid) {
+      at = buffer->numrows;
+      break;
     }
 
-    if (conf->activeBuffer->syntax->flags & HL_HIGHLIGHT_NUMBERS) {
-      if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) ||
-          (c == '.' && prev_hl == HL_NUMBER)) {
-        row->hl[i] = HL_NUMBER;
-        ++i;
-        prev_sep = 0;
-        continue;
+    in_comment = row->hl_open_comment;
+  }
+
+  buffer->hl_frontier = at;
+
+  return redraw;
+}
+
+/**
+ * A slice of the buffer highlighted by one thread of the initial pass. The
+ * thread allocates from an arena of its own, which is handed over to the
+ * buffer once it is done.
+ */
+struct hlChunk {
+  struct editorSyntax *syntax;
+  struct lineStore *rows;
+  struct arena arena;
+  int from;
+  int to;
+  int first_stale;
+  int last_stale;
+  int threaded;
+  pthread_t thread;
+};
+
+/**
+ * Highlights the rows of a chunk, guessing that the chunk starts outside of
+ * a comment. Rows that were rendered before are left stale, since freeing
+ * their old arrays would touch the buffer arena. The first and last of them
+ * are recorded in the chunk.
+ */
+static void *editorSyntaxChunk(void *arg) {
+  struct hlChunk *chunk = arg;
+  struct lineIter it;
+  int in_comment = 0;
+
+  chunk->first_stale = -1;
+  chunk->last_stale = -1;
+
+  lsIterInit(chunk->rows, chunk->from, &it);
+
+  for (int at = chunk->from; at < chunk->to; ++at) {
+    erow *row = lsIterNext(&it);
+
+    if (row->render || row->tabs || row->hl) {
+      if (chunk->first_stale == -1) {
+        chunk->first_stale = at;
       }
+
+      chunk->last_stale = at;
+      in_comment = row->hl_open_comment;
+      continue;
     }
 
-    if (prev_sep) {
-      int j;
+    editorUpdateRender(&chunk->arena, row);
+    editorHighlightRow(chunk->syntax, &chunk->arena, row, in_comment);
 
-      for (j = 0; keywords[j]; ++j) {
-        int klen = strlen(keywords[j]);
+    row->hl_entry = in_comment;
+    row->stale = 0;
 
-        int kw2 = keywords[j][klen - 1] == '|';
+    in_comment = row->hl_open_comment;
+  }
 
-        if (kw2) {
-          klen--;
-        }
+  return NULL;
+}
 
-        if (!strncmp(&row->render[i], keywords[j], klen) &&
-            is_separator(row->render[i + klen])) {
-          memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-          i += klen;
-          break;
-        }
+/**
+ * Highlights a large buffer on one thread per core. Every chunk but the first
+ * guesses the state it starts in. Afterwards the frontier is put at the first
+ * chunk that guessed wrong or has a row left stale, and hl_valid past the
+ * last one, so that the idle walk only redoes the rows from there up to where
+ * the state agrees again.
+ */
+static void editorHighlightParallel(editorConfig_t *conf) {
+  buffer_t *buffer = conf->activeBuffer;
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  int n = cores > JDEDIT_HL_MAX_THREADS ? JDEDIT_HL_MAX_THREADS : cores;
+  struct hlChunk chunks[JDEDIT_HL_MAX_THREADS];
+
+  // On a single core the rows are better left to the lazy highlighting.
+  if (n < 2) {
+    return;
+  }
+
+  for (int i = 0; i < n; ++i) {
+    chunks[i].syntax = buffer->syntax;
+    chunks[i].rows = &buffer->rows;
+    chunks[i].from = (long long)buffer->numrows * i / n;
+    chunks[i].to = (long long)buffer->numrows * (i + 1) / n;
+    arInit(&chunks[i].arena);
+  }
+
+  // The calling thread takes the first chunk itself, and any chunk that no
+  // thread could be started for.
+  for (int i = 1; i < n; ++i) {
+    chunks[i].threaded = pthread_create(&chunks[i].thread, NULL,
+                                        editorSyntaxChunk, &chunks[i]) == 0;
+  }
+
+  editorSyntaxChunk(&chunks[0]);
+
+  for (int i = 1; i < n; ++i) {
+    if (!chunks[i].threaded) {
+      editorSyntaxChunk(&chunks[i]);
+    }
+  }
+
+  for (int i = 0; i < n; ++i) {
+    if (i > 0 && chunks[i].threaded) {
+      pthread_join(chunks[i].thread, NULL);
+    }
+
+    arAdopt(&buffer->arena, &chunks[i].arena);
+  }
+
+  if (!editorSyntaxHasState(buffer->syntax)) {
+    return;
+  }
+
+  int frontier = buffer->numrows;
+  int valid = -1;
+
+  for (int i = n - 1; i >= 0; --i) {
+    struct hlChunk *chunk = &chunks[i];
+
+    if (chunk->first_stale != -1) {
+      frontier = chunk->first_stale;
+
+      if (valid == -1) {
+        valid = chunk->last_stale + 1;
       }
+    }
 
-      if (keywords[j] != NULL) {
-        prev_sep = 0;
-        continue;
+    if (i > 0 && chunk->from < chunk->to &&
+        editorGetRow(buffer, chunk->from - 1)->hl_open_comment) {
+      frontier = chunk->from;
+
+      if (valid == -1) {
+        valid = chunk->from;
       }
     }
+  }
 
-    prev_sep = is_separator(c);
-    ++i;
+  buffer->hl_frontier = frontier;
+  buffer->hl_valid = valid == -1 ? buffer->numrows : valid;
+}
+
+void editorInvalidateSyntax(editorConfig_t *conf, int at, int delta) {
+  buffer_t *buffer = conf->activeBuffer;
+
+  // Rows after the edit keep their highlight, and only the first of them may
+  // now be entered in another state. Once the walk has reached the end, that
+  // holds for every row after the edit. Otherwise the rows from hl_valid on
+  // move along with inserted and deleted rows, and an edit among them cuts
+  // the range short.
+  if (buffer->hl_frontier < buffer->numrows && at < buffer->hl_valid) {
+    buffer->hl_valid += delta;
+  } else {
+    buffer->hl_valid = delta < 0 ? at : at + 1;
+  }
+
+  if (at < buffer->hl_frontier) {
+    buffer->hl_frontier = at;
   }
+}
+
+void editorUpdateSyntaxRange(editorConfig_t *conf, int from, int to) {
+  buffer_t *buffer = conf->activeBuffer;
+  struct lineIter it;
+  int stateful = editorSyntaxHasState(buffer->syntax);
+  int in_comment = 0;
+  int at = from;
+
+  if (to >= buffer->numrows) {
+    to = buffer->numrows - 1;
+  }
+
+  if (stateful) {
+    if (from - buffer->hl_frontier <= JDEDIT_HL_SYNC_ROWS) {
+      editorSyntaxAdvance(conf, to);
+      return;
+    }
+
+    // The frontier is too far behind to catch up now. The rows are
+    // highlighted from the state recorded for the row above them instead,
+    // and the idle walk redoes them if that turns out to be wrong.
+    if (at > 0) {
+      in_comment = editorGetRow(buffer, at - 1)->hl_open_comment;
+    }
+  }
+
+  lsIterInit(&buffer->rows, at, &it);
 
-  int changed = (row->hl_open_comment != in_comment);
+  for (; at <= to; ++at) {
+    erow *row = lsIterNext(&it);
+    int open_comment = row->hl_open_comment;
 
-  row->hl_open_comment = in_comment;
+    editorSyntaxRefreshRow(conf, row, stateful ? in_comment : 0);
 
-  if (changed && row->idx + 1 < conf->activeBuffer->numrows) {
-    editorUpdateSyntax(conf, &conf->activeBuffer->row[row->idx + 1]);
+    in_comment = row->hl_open_comment;
+
+    // The row below was highlighted from the state this row used to end in.
+    if (at == to && in_comment != open_comment && at >= buffer->hl_valid) {
+      buffer->hl_valid = at + 1;
+    }
   }
 }
 
+int editorUpdateSyntaxIdle(editorConfig_t *conf, int *redraw) {
+  buffer_t *buffer = conf->activeBuffer;
+
+  *redraw = 0;
+
+  if (!editorSyntaxHasState(buffer->syntax) ||
+      buffer->hl_frontier >= buffer->numrows) {
+    return 0;
+  }
+
+  *redraw = editorSyntaxAdvance(conf,
+                                buffer->hl_frontier + JDEDIT_HL_IDLE_ROWS - 1);
+
+  return buffer->hl_frontier < buffer->numrows;
+}
+
+void editorInvalidateSyntaxAll(editorConfig_t *conf) {
+  struct lineIter it;
+  erow *row;
+
+  // Rows of a mapping are never highlighted, and marking them would pull
+  // every line of the file through the row cache.
+  if (conf->activeBuffer->map) {
+    return;
+  }
+
+  lsIterInit(&conf->activeBuffer->rows, 0, &it);
+
+  while ((row = lsIterNext(&it)) != NULL) {
+    row->stale = 1;
+  }
+
+  conf->activeBuffer->hl_frontier = 0;
+  conf->activeBuffer->hl_valid = conf->activeBuffer->numrows;
+}
+
 int editorSyntaxToColor(int hl) {
   switch (hl) {
   case HL_NUMBER:
@@ -220,6 +813,7 @@ void editorSelectSyntaxHighlight(editorConfig_t *conf) {
   conf->activeBuffer->syntax = NULL;
 
   if (conf->activeBuffer->filename == NULL) {
+    editorInvalidateSyntaxAll(conf);
     return;
   }
 
@@ -237,10 +831,16 @@ void editorSelectSyntaxHighlight(editorConfig_t *conf) {
           (!is_ext && strstr(conf->activeBuffer->filename, s->filematch[i]))) {
         conf->activeBuffer->syntax = s;
 
-        int filerow;
+        if (!s->compiled) {
+          kwCompile(s);
+          lxCompile(s);
+          s->compiled = 1;
+        }
+
+        editorInvalidateSyntaxAll(conf);
 
-        for (filerow = 0; filerow < conf->activeBuffer->numrows; ++filerow) {
-          editorUpdateSyntax(conf, &conf->activeBuffer->row[filerow]);
+        if (conf->activeBuffer->numrows >= JDEDIT_HL_PARALLEL_ROWS) {
+          editorHighlightParallel(conf);
         }
 
         return;
@@ -248,4 +848,6 @@ void editorSelectSyntaxHighlight(editorConfig_t *conf) {
       ++i;
     }
   }
+
+  editorInvalidateSyntaxAll(conf);
 }
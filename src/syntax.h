@@ -27,6 +27,79 @@
 
 #include "editor.h"
 #include "row.h"
+#include "scan.h"
+
+/**
+ * The keywords of a syntax compiled into a perfect hash table. Every keyword
+ * has a slot of its own, so a lookup hashes the word once and compares it
+ * against a single entry.
+ */
+struct keywordSlot {
+  const char *word;
+  int len;
+  int hl;
+};
+
+struct keywordTable {
+  struct keywordSlot *slots;
+  unsigned int mask;
+  unsigned int seed;
+  int max_len;
+};
+
+/**
+ * A syntax compiled into a table-driven lexer. Every byte maps to a class,
+ * and the table gives the highlight and next state for each state and class.
+ * A byte that may start a comment delimiter gets the class LX_C_DELIM, and is
+ * looked up by its base class when the delimiter does not follow.
+ */
+#define LX_MAX_QUOTES 4
+
+enum lexState {
+  LX_SEP = 0,
+  LX_WORD,
+  LX_NUMBER,
+  LX_COMMENT,
+  LX_STRING,
+  LX_STATES = LX_STRING + 2 * LX_MAX_QUOTES
+};
+
+enum lexClass {
+  LX_C_OTHER = 0,
+  LX_C_SEP,
+  LX_C_DOT,
+  LX_C_DIGIT,
+  LX_C_ESCAPE,
+  LX_C_DELIM,
+  LX_C_QUOTE,
+  LX_CLASSES = LX_C_QUOTE + LX_MAX_QUOTES
+};
+
+enum lexAction { LX_EMIT = 0, LX_KEYWORD, LX_DELIM, LX_BASE };
+
+struct lexStep {
+  unsigned char action;
+  unsigned char hl;
+  unsigned char next;
+};
+
+/**
+ * In some states most bytes keep the lexer where it is, such as everything
+ * but the closing delimiter inside a comment. When only a few bytes do not,
+ * they are listed in stops, and the bytes up to the next one are taken as one
+ * run of run_hl. nstops is -1 for the states where that does not pay off.
+ */
+struct syntaxLexer {
+  unsigned char cls[256];
+  unsigned char base[256];
+  struct lexStep table[LX_STATES][LX_CLASSES];
+  unsigned char stops[LX_STATES][SCAN_MAX_SET];
+  int nstops[LX_STATES];
+  int run_hl[LX_STATES];
+  int scs_len;
+  int mcs_len;
+  int mce_len;
+};
 
 struct editorSyntax {
   char *filetype;
@@ -36,6 +109,9 @@ struct editorSyntax {
   char *multiline_comment_start;
   char *multiline_comment_end;
   int flags;
+  int compiled;
+  struct keywordTable kwtable;
+  struct syntaxLexer lexer;
 };
 
 enum editorHighlight {
@@ -52,7 +128,31 @@ enum editorHighlight {
 #define HL_HIGHLIGHT_NUMBERS (1 << 0)
 #define HL_HIGHLIGHT_STRINGS (1 << 1)
 
-void editorUpdateSyntax(editorConfig_t *conf, erow *row);
+/**
+ * Highlighting is done lazily. Edits only mark rows as stale and move the
+ * highlight frontier back, and rows are brought up to date when they are
+ * about to be drawn or searched.
+ *
+ * Every row remembers the state it was highlighted in, so a change only has
+ * to be followed until the state agrees with the one recorded again. When the
+ * frontier is far behind the rows on screen, they are highlighted from the
+ * recorded states and the rest of the walk is left to
+ * editorUpdateSyntaxIdle, which the highlight worker runs while the editor
+ * waits for input.
+ *
+ * editorInvalidateSyntax is told about changed rows with a delta of 0, and
+ * about inserted and deleted rows with a delta of 1 and -1, before numrows is
+ * updated.
+ */
+void editorInvalidateSyntax(editorConfig_t *conf, int at, int delta);
+void editorInvalidateSyntaxAll(editorConfig_t *conf);
+void editorUpdateSyntaxRange(editorConfig_t *conf, int from, int to);
+
+/**
+ * Advances the highlight frontier by one slice. Returns non-zero while there
+ * is more to do, and sets redraw if a row on screen changed.
+ */
+int editorUpdateSyntaxIdle(editorConfig_t *conf, int *redraw);
 
 int editorSyntaxToColor(int hl);
 
@@ -27,6 +27,7 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -69,6 +70,22 @@ void terminalEnableRawMode(editorConfig_t *conf) {
   }
 }
 
+/**
+ * Waits until there is a key to read, or until fd can be read from. Returns 1
+ * for a key and 0 for fd.
+ */
+int terminalWaitKey(int fd) {
+  struct pollfd fds[2] = {{STDIN_FILENO, POLLIN, 0}, {fd, POLLIN, 0}};
+
+  while (poll(fds, 2, -1) == -1) {
+    if (errno != EINTR) {
+      die("poll");
+    }
+  }
+
+  return (fds[0].revents & POLLIN) != 0 || (fds[1].revents & POLLIN) == 0;
+}
+
 int terminalReadKey() {
   int nread;
   char c;
@@ -31,6 +31,7 @@
 void terminalDisableRawMode(editorConfig_t *conf);
 void terminalEnableRawMode(editorConfig_t *conf);
 int terminalReadKey();
+int terminalWaitKey(int fd);
 int terminalGetCursorPosition(int *rows, int *cols);
 int terminalGetWindowSize(int *rows, int *cols);
 void terminalWrite(const char *s, int len);
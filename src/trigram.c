@@ -0,0 +1,456 @@
+/**
+ * @file trigram.c
+ * @author Joakim Bertils
+ * @version 0.1
+ * @date 2021-04-18
+ *
+ * @brief Trigram index of a mapped file.
+ *
+ * @copyright Copyright (C) 2021, Joakim Bertils
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https: //www.gnu.org/licenses/>.
+ *
+ */
+
+#include "trigram.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "mapped_file.h"
+
+#define TI_MAGIC "JDTRIGR1"
+
+/**
+ * Folds a byte to lower case.
+ */
+static unsigned char tiFold(unsigned char c) {
+  return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+/**
+ * Returns the bucket of the trigram in the low 24 bits of t.
+ */
+static unsigned int tiBucket(uint32_t t) {
+  return ((t & 0xffffff) * 2654435761u) >> 16;
+}
+
+static size_t tiBitsSize(struct trigramIndex *ti) {
+  return (size_t)TI_BUCKETS * ti->words * sizeof(uint64_t);
+}
+
+/**
+ * Returns the name of the index file, in $XDG_CACHE_HOME/jdedit or
+ * ~/.cache/jdedit, creating the directories as needed. Returns NULL if there
+ * is nowhere to keep it.
+ */
+static char *tiCachePath(const struct tiHeader *header) {
+  const char *xdg = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+  char dir[4096];
+
+  if (xdg && xdg[0]) {
+    snprintf(dir, sizeof(dir), "%s", xdg);
+  } else if (home && home[0]) {
+    snprintf(dir, sizeof(dir), "%s/.cache", home);
+  } else {
+    return NULL;
+  }
+
+  if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+    return NULL;
+  }
+
+  size_t len = strlen(dir);
+
+  snprintf(dir + len, sizeof(dir) - len, "/jdedit");
+
+  if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+    return NULL;
+  }
+
+  size_t pathlen = strlen(dir) + 64;
+  char *path = malloc(pathlen);
+
+  if (path) {
+    snprintf(path, pathlen, "%s/%llx-%llx.tri",
+             dir, (unsigned long long)header->dev,
+             (unsigned long long)header->ino);
+  }
+
+  return path;
+}
+
+/**
+ * Loads the saved index, if there is one for the file as it is now.
+ */
+static int tiLoad(struct trigramIndex *ti) {
+  struct tiHeader header;
+  struct stat st;
+  int fd = open(ti->path, O_RDONLY);
+
+  if (fd == -1) {
+    return -1;
+  }
+
+  // An index of the file as it was before is of no more use.
+  if (read(fd, &header, sizeof(header)) != sizeof(header) ||
+      memcmp(&header, &ti->header, sizeof(header)) != 0 ||
+      fstat(fd, &st) == -1 ||
+      (size_t)st.st_size != sizeof(header) + tiBitsSize(ti)) {
+    close(fd);
+    unlink(ti->path);
+    return -1;
+  }
+
+  // The modification time tells how recently the index was used.
+  futimens(fd, NULL);
+
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+  close(fd);
+
+  if (map == MAP_FAILED) {
+    return -1;
+  }
+
+  ti->map = map;
+  ti->mapSize = st.st_size;
+  ti->bits = (uint64_t *)((char *)map + sizeof(header));
+
+  return 0;
+}
+
+/**
+ * An index file in the cache directory.
+ */
+struct tiCacheEntry {
+  char *name;
+  off_t size;
+  struct timespec mtime;
+};
+
+static int tiCacheOrder(const void *a, const void *b) {
+  const struct tiCacheEntry *x = a;
+  const struct tiCacheEntry *y = b;
+
+  if (x->mtime.tv_sec != y->mtime.tv_sec) {
+    return x->mtime.tv_sec < y->mtime.tv_sec ? -1 : 1;
+  }
+
+  return (x->mtime.tv_nsec > y->mtime.tv_nsec) -
+         (x->mtime.tv_nsec < y->mtime.tv_nsec);
+}
+
+/**
+ * Returns non-zero if name is that of an index file. Files that are still
+ * being written by tiSave end in a mkstemp suffix after ".tri", and are left
+ * alone, since they may belong to another editor that is about to rename
+ * them.
+ */
+static int tiIsIndexName(const char *name) {
+  size_t len = strlen(name);
+
+  return len > 4 && strcmp(&name[len - 4], ".tri") == 0;
+}
+
+/**
+ * Removes the least recently used index files from the cache directory
+ * until the rest take up at most TI_CACHE_BYTES, keeping the index at path
+ * regardless. Indexes of files that were deleted, or replaced by a save, are
+ * never used again, so this is where they go.
+ */
+static void tiPrune(const char *path) {
+  const char *slash = strrchr(path, '/');
+  char dir[4096];
+
+  snprintf(dir, sizeof(dir), "%.*s", (int)(slash - path), path);
+
+  DIR *d = opendir(dir);
+
+  if (d == NULL) {
+    return;
+  }
+
+  struct tiCacheEntry *entries = NULL;
+  int n = 0;
+  int cap = 0;
+  off_t total = 0;
+  struct dirent *de;
+
+  while ((de = readdir(d)) != NULL) {
+    struct stat st;
+
+    if (!tiIsIndexName(de->d_name) ||
+        strcmp(de->d_name, slash + 1) == 0 ||
+        fstatat(dirfd(d), de->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1 ||
+        !S_ISREG(st.st_mode)) {
+      continue;
+    }
+
+    if (n == cap) {
+      cap = cap ? cap * 2 : 16;
+
+      struct tiCacheEntry *grown = realloc(entries, sizeof(*entries) * cap);
+
+      if (grown == NULL) {
+        break;
+      }
+
+      entries = grown;
+    }
+
+    entries[n].name = strdup(de->d_name);
+
+    if (entries[n].name == NULL) {
+      break;
+    }
+
+    entries[n].size = st.st_size;
+    entries[n].mtime = st.st_mtim;
+    total += st.st_size;
+    ++n;
+  }
+
+  struct stat st;
+
+  if (stat(path, &st) == 0) {
+    total += st.st_size;
+  }
+
+  qsort(entries, n, sizeof(*entries), tiCacheOrder);
+
+  for (int i = 0; i < n; ++i) {
+    if (total > TI_CACHE_BYTES &&
+        unlinkat(dirfd(d), entries[i].name, 0) == 0) {
+      total -= entries[i].size;
+    }
+
+    free(entries[i].name);
+  }
+
+  free(entries);
+  closedir(d);
+}
+
+/**
+ * Writes the index next to where it is kept and renames it into place, so
+ * that a reader never sees half an index.
+ */
+static void tiSave(struct trigramIndex *ti) {
+  size_t tmplen = strlen(ti->path) + 8;
+  char *tmp = malloc(tmplen);
+
+  if (tmp == NULL) {
+    return;
+  }
+
+  snprintf(tmp, tmplen, "%s.XXXXXX", ti->path);
+
+  int fd = mkstemp(tmp);
+
+  if (fd != -1) {
+    size_t size = tiBitsSize(ti);
+    int ok = write(fd, &ti->header, sizeof(ti->header)) ==
+                 sizeof(ti->header) &&
+             write(fd, ti->bits, size) == (ssize_t)size;
+
+    if (close(fd) != 0 || !ok || rename(tmp, ti->path) != 0) {
+      unlink(tmp);
+    } else {
+      tiPrune(ti->path);
+    }
+  }
+
+  free(tmp);
+}
+
+/**
+ * Collects the trigrams of a block in a bitmap of buckets. Trigrams that
+ * span a line ending are left out, since a query never does.
+ */
+static void tiScanBlock(const char *s, size_t len, uint64_t *seen) {
+  uint32_t t = 0;
+  int run = 0;
+
+  for (size_t i = 0; i < len; ++i) {
+    unsigned char c = s[i];
+
+    if (c == '\n') {
+      run = 0;
+      continue;
+    }
+
+    t = (t << 8) | tiFold(c);
+
+    if (++run >= 3) {
+      unsigned int bucket = tiBucket(t);
+
+      seen[bucket >> 6] |= (uint64_t)1 << (bucket & 63);
+    }
+  }
+}
+
+static void *tiBuild(void *arg) {
+  struct trigramIndex *ti = arg;
+  struct mappedFile *mf = ti->mf;
+  uint64_t seen[TI_BUCKETS / 64];
+  uint64_t *bits = calloc(TI_BUCKETS, ti->words * sizeof(uint64_t));
+
+  if (bits == NULL) {
+    return NULL;
+  }
+
+  for (int block = 0; block < ti->nblocks; ++block) {
+    int line = block * TI_BLOCK_LINES;
+    int count = mf->numLines - line;
+    const char *s;
+    size_t len;
+
+    if (atomic_load(&ti->cancel)) {
+      free(bits);
+      return NULL;
+    }
+
+    if (count > TI_BLOCK_LINES) {
+      count = TI_BLOCK_LINES;
+    }
+
+    mfPeekLines(mf, line, count, &s, &len);
+
+    memset(seen, 0, sizeof(seen));
+    tiScanBlock(s, len, seen);
+
+    mfRelease(mf, s, len);
+
+    // The bitmap of the block is turned on its side, one bucket at a time,
+    // into the bitmaps of the buckets.
+    uint64_t mask = (uint64_t)1 << (block & 63);
+    int word = block >> 6;
+
+    for (int i = 0; i < TI_BUCKETS / 64; ++i) {
+      uint64_t w = seen[i];
+
+      while (w) {
+        int bucket = i * 64 + __builtin_ctzll(w);
+
+        bits[(size_t)bucket * ti->words + word] |= mask;
+        w &= w - 1;
+      }
+    }
+  }
+
+  ti->bits = bits;
+  atomic_store(&ti->ready, 1);
+
+  if (ti->path) {
+    tiSave(ti);
+  }
+
+  return NULL;
+}
+
+int tiOpen(struct trigramIndex *ti, struct mappedFile *mf,
+           const char *filename) {
+  struct stat st;
+
+  memset(ti, 0, sizeof(*ti));
+
+  ti->mf = mf;
+  ti->nblocks = (mf->numLines + TI_BLOCK_LINES - 1) / TI_BLOCK_LINES;
+  ti->words = (ti->nblocks + 63) / 64;
+
+  atomic_init(&ti->ready, 0);
+  atomic_init(&ti->cancel, 0);
+
+  if (ti->nblocks == 0 || stat(filename, &st) == -1 ||
+      (size_t)st.st_size != mf->size) {
+    return -1;
+  }
+
+  memcpy(ti->header.magic, TI_MAGIC, sizeof(ti->header.magic));
+  ti->header.dev = st.st_dev;
+  ti->header.ino = st.st_ino;
+  ti->header.size = st.st_size;
+  ti->header.mtimeSec = st.st_mtim.tv_sec;
+  ti->header.mtimeNsec = st.st_mtim.tv_nsec;
+  ti->header.blockLines = TI_BLOCK_LINES;
+  ti->header.buckets = TI_BUCKETS;
+  ti->header.nblocks = ti->nblocks;
+
+  // Without a cache directory the index is still built, but only kept for
+  // as long as the file is open.
+  ti->path = tiCachePath(&ti->header);
+
+  if (ti->path && tiLoad(ti) == 0) {
+    atomic_store(&ti->ready, 1);
+    return 0;
+  }
+
+  if (pthread_create(&ti->thread, NULL, tiBuild, ti) != 0) {
+    free(ti->path);
+    return -1;
+  }
+
+  ti->building = 1;
+
+  return 0;
+}
+
+void tiClose(struct trigramIndex *ti) {
+  if (ti->building) {
+    atomic_store(&ti->cancel, 1);
+    pthread_join(ti->thread, NULL);
+  }
+
+  if (ti->map) {
+    munmap(ti->map, ti->mapSize);
+  } else {
+    free(ti->bits);
+  }
+
+  free(ti->path);
+}
+
+int tiCandidates(struct trigramIndex *ti, const char *s, int len,
+                 uint64_t *blocks) {
+  if (len < 3 || !atomic_load(&ti->ready)) {
+    return 0;
+  }
+
+  for (int i = 0; i < ti->words; ++i) {
+    blocks[i] = ~(uint64_t)0;
+  }
+
+  uint32_t t = tiFold(s[0]) << 8 | tiFold(s[1]);
+
+  for (int i = 2; i < len; ++i) {
+    t = (t << 8) | tiFold(s[i]);
+
+    const uint64_t *row = &ti->bits[(size_t)tiBucket(t) * ti->words];
+
+    for (int j = 0; j < ti->words; ++j) {
+      blocks[j] &= row[j];
+    }
+  }
+
+  return 1;
+}
@@ -0,0 +1,123 @@
+/**
+ * @file trigram.h
+ * @author Joakim Bertils
+ * @version 0.1
+ * @date 2021-04-18
+ *
+ * @brief Trigram index of a mapped file.
+ *
+ * @copyright Copyright (C) 2021, Joakim Bertils
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https: //www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _TRIGRAM_H
+#define _TRIGRAM_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct mappedFile;
+
+/**
+ * The file is indexed in blocks of this many lines. It is a multiple of
+ * MF_INDEX_STRIDE, so that the start of a block is always in the line index
+ * of the mapping.
+ */
+#define TI_BLOCK_LINES 16384
+
+/**
+ * Trigrams are hashed into this many buckets.
+ */
+#define TI_BUCKETS (1 << 16)
+
+/**
+ * The cache directory is kept under this many bytes, by removing the indexes
+ * that were used the longest time ago.
+ */
+#define TI_CACHE_BYTES (256 << 20)
+
+/**
+ * The start of an index file. The index belongs to the file with the given
+ * device, inode, size and modification time, and is rebuilt if any of them
+ * change.
+ */
+struct tiHeader {
+  char magic[8];
+  uint64_t dev;
+  uint64_t ino;
+  uint64_t size;
+  int64_t mtimeSec;
+  int64_t mtimeNsec;
+  uint32_t blockLines;
+  uint32_t buckets;
+  uint32_t nblocks;
+  uint32_t reserved;
+};
+
+/**
+ * For every bucket of trigrams, a bitmap of the blocks that contain a
+ * trigram in the bucket. Letters are folded to lower case, so the same index
+ * serves searches with and without case. Finding the blocks that may contain
+ * a string only reads the bitmaps of its trigrams, so it does not depend on
+ * the size of the file.
+ *
+ * The index is built by a thread of its own the first time a file is
+ * opened, and saved in the cache directory, from where it is loaded the
+ * next time. An index that no longer matches its file is removed when it is
+ * found, and the rest are removed least recently used first once the
+ * directory grows past TI_CACHE_BYTES. It is only used once ready is set.
+ */
+struct trigramIndex {
+  struct mappedFile *mf;
+  struct tiHeader header;
+  char *path;
+
+  int nblocks;
+  int words;
+  uint64_t *bits;
+
+  void *map;
+  size_t mapSize;
+
+  atomic_int ready;
+  atomic_int cancel;
+  pthread_t thread;
+  int building;
+};
+
+/**
+ * Sets up the index of the file behind mf, named filename. A saved index is
+ * loaded if there is one for the file as it is now, and otherwise one is
+ * built in the background. Returns -1 if the file can not be indexed.
+ */
+int tiOpen(struct trigramIndex *ti, struct mappedFile *mf,
+           const char *filename);
+
+/**
+ * Stops building the index, if it is still being built, and frees it.
+ */
+void tiClose(struct trigramIndex *ti);
+
+/**
+ * Sets the bits in blocks, which has room for ti->words words, of the blocks
+ * that may contain the len bytes at s. Returns 0 without touching blocks if
+ * the index can not tell, because it is not ready or s is too short.
+ */
+int tiCandidates(struct trigramIndex *ti, const char *s, int len,
+                 uint64_t *blocks);
+
+#endif